@@ -82,6 +82,29 @@ void AABB::include(const AABB& b)
 	mMax.z = std::max(mMax.z, b.mMax.z);
 }
 
+/**
+ * Sets the bounding box to the intersection of the current box and the box b.
+ * The result is empty (see isEmpty()) if the boxes do not overlap.
+ */
+void AABB::clip(const AABB& b)
+{
+	mMin.x = std::max(mMin.x, b.mMin.x);
+	mMin.y = std::max(mMin.y, b.mMin.y);
+	mMin.z = std::max(mMin.z, b.mMin.z);
+	mMax.x = std::min(mMax.x, b.mMax.x);
+	mMax.y = std::min(mMax.y, b.mMax.y);
+	mMax.z = std::min(mMax.z, b.mMax.z);
+}
+
+/**
+ * Returns true if the box contains no points, i.e. if the minimum is
+ * larger than the maximum along any axis.
+ */
+bool AABB::isEmpty() const
+{
+	return mMin.x > mMax.x || mMin.y > mMax.y || mMin.z > mMax.z;
+}
+
 /**
  * Grow the box by a distance d in all directions.
  */
@@ -125,27 +148,21 @@ int AABB::getLargestAxis() const
  */
 bool AABB::intersect(const Ray& ray, float& tmin, float& tmax) const
 {
+	// The ray's cached direction signs select the entry and exit plane
+	// on each axis, so there is no per-axis swap or early exit. The
+	// running interval is passed first to min/max, which makes a NaN
+	// from 0*inf (ray in a slab plane) leave the interval unchanged.
+	const Point3D* bounds[2] = { &mMin, &mMax };
 	float t0 = ray.minT;
 	float t1 = ray.maxT;
+	t0 = std::max(t0, ((*bounds[ray.sign[0]]).x - ray.orig.x) * ray.invDir.x);
+	t1 = std::min(t1, ((*bounds[1 - ray.sign[0]]).x - ray.orig.x) * ray.invDir.x);
+	t0 = std::max(t0, ((*bounds[ray.sign[1]]).y - ray.orig.y) * ray.invDir.y);
+	t1 = std::min(t1, ((*bounds[1 - ray.sign[1]]).y - ray.orig.y) * ray.invDir.y);
+	t0 = std::max(t0, ((*bounds[ray.sign[2]]).z - ray.orig.z) * ray.invDir.z);
+	t1 = std::min(t1, ((*bounds[1 - ray.sign[2]]).z - ray.orig.z) * ray.invDir.z);
 
-	// Loop over the three axes and compute the hit time for the
-	// two axis-aligned bounding box planes in each, decreasing the
-	// parametric range of the ray until start>end time, which means
-	// the ray missed the box, or until we finish which means there
-	// is an intersection.
-	for (int i = 0; i < 3; i++) {
-		float invDir = 1.0f / ray.dir(i);
-		float tNear = (mMin(i) - ray.orig(i)) * invDir;
-		float tFar  = (mMax(i) - ray.orig(i)) * invDir;
-		
-		if (tNear > tFar) swap(tNear,tFar);
-		
-		if (tNear > t0) t0 = tNear;
-		if (tFar < t1) t1 = tFar;
-		if (t0 > t1) return false;
-	}
-	
 	tmin = t0;
 	tmax = t1;
-	return true;
+	return t0 <= t1;
 }
@@ -33,6 +33,8 @@ public:
 	void init(const Point3D& p);
 	void include(const Point3D& p);
 	void include(const AABB& b);
+	void clip(const AABB& b);
+	bool isEmpty() const;
 	void grow(float d);
 	float getVolume() const;
 	float getArea() const;
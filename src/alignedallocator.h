@@ -0,0 +1,57 @@
+/*
+ *  alignedallocator.h
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#ifndef ALIGNEDALLOCATOR_H
+#define ALIGNEDALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <xmmintrin.h>
+
+/**
+ * Minimal std::allocator replacement returning memory aligned to
+ * Alignment bytes. Used for the acceleration structure node arrays,
+ * so that nodes never straddle cache lines and SSE data can be
+ * loaded with aligned loads.
+ */
+template<class T, size_t Alignment>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template<class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() { }
+	template<class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+	T* allocate(size_t n)
+	{
+		void* p = _mm_malloc(n * sizeof(T), Alignment);
+		if (!p)
+			throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, size_t) { _mm_free(p); }
+
+	void construct(T* p, const T& v) { new (p) T(v); }
+	void destroy(T* p) { p->~T(); }
+	size_t max_size() const { return size_t(-1) / sizeof(T); }
+
+	template<class U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+	template<class U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ *  allocationcounter.cpp
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#include "defines.h"
+#include "allocationcounter.h"
+
+#ifdef COUNT_ALLOCATIONS
+
+#include <new>
+#include <cstdlib>
+
+/// Number of allocations made by the current thread.
+static THREAD_LOCAL unsigned long allocationCount = 0;
+
+/**
+ * Returns the number of heap allocations made by the calling thread.
+ */
+unsigned long getAllocationCount()
+{
+	return allocationCount;
+}
+
+void* operator new(size_t size)
+{
+	++allocationCount;
+	void* p = std::malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) throw()
+{
+	++allocationCount;
+	return std::malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& nt) throw()
+{
+	return operator new(size, nt);
+}
+
+void operator delete(void* p) throw()
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+	std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) throw()
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) throw()
+{
+	std::free(p);
+}
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ *  allocationcounter.h
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+/**
+ * Heap allocation counting, enabled by defining COUNT_ALLOCATIONS.
+ * The global operator new is replaced by one that counts the allocations
+ * made by each thread. Scene::intersect() uses the count to verify that
+ * tracing a ray never allocates memory.
+ */
+#ifdef COUNT_ALLOCATIONS
+unsigned long getAllocationCount();
+#endif
+
+#endif
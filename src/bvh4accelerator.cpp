@@ -0,0 +1,260 @@
+/*
+*  bvh4accelerator.cpp
+*  prTracer
+*
+*/
+
+#include "bvh4accelerator.h"
+#include "traversalstack.h"
+#include "raystats.h"
+#include <algorithm>
+
+using namespace std;
+
+// Each visited node leaves at most three pending siblings on the stack,
+// plus up to four children of the deepest node.
+typedef TraversalStack<int, 3 * BVHAccelerator::maxDepth + 4> NodeStack;
+
+/**
+ * Ray data splatted into SSE registers once per traversal. The near/far
+ * indices select which of the six box planes is entered first on each
+ * axis, so the slab test needs no per-axis min/max swap.
+ */
+struct SSERay {
+	__m128 orig[3];
+	__m128 invDir[3];
+	__m128 minT;
+	int nearPlane[3];
+	int farPlane[3];
+
+	SSERay(const Ray& ray)
+	{
+		for (int i = 0; i < 3; ++i) {
+			orig[i] = _mm_set1_ps(ray.orig(i));
+			invDir[i] = _mm_set1_ps(ray.invDir(i));
+			nearPlane[i] = ray.sign[i] * 3 + i;
+			farPlane[i] = (1 - ray.sign[i]) * 3 + i;
+		}
+		minT = _mm_set1_ps(ray.minT);
+	}
+};
+
+/**
+ * Tests the ray against the four child boxes of the node. Returns a bit
+ * mask of the children that are hit, and their entry times in tNear.
+ */
+static inline int intersectNode(const BVH4Node& node, const SSERay& r, const __m128& maxT, __m128& tNear)
+{
+	__m128 t0x = _mm_mul_ps(_mm_sub_ps(node.bbox[r.nearPlane[0]], r.orig[0]), r.invDir[0]);
+	__m128 t0y = _mm_mul_ps(_mm_sub_ps(node.bbox[r.nearPlane[1]], r.orig[1]), r.invDir[1]);
+	__m128 t0z = _mm_mul_ps(_mm_sub_ps(node.bbox[r.nearPlane[2]], r.orig[2]), r.invDir[2]);
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(node.bbox[r.farPlane[0]], r.orig[0]), r.invDir[0]);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(node.bbox[r.farPlane[1]], r.orig[1]), r.invDir[1]);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(node.bbox[r.farPlane[2]], r.orig[2]), r.invDir[2]);
+
+	// The slab times go first, so a NaN from 0*inf is discarded by min/max.
+	__m128 t0 = _mm_max_ps(t0x, _mm_max_ps(t0y, _mm_max_ps(t0z, r.minT)));
+	__m128 t1 = _mm_min_ps(t1x, _mm_min_ps(t1y, _mm_min_ps(t1z, maxT)));
+	tNear = t0;
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+BVH4Accelerator::BVH4Accelerator(BVHAccelerator::SplitMethod method) : splitMethod(method), treeDepth(0)
+{
+}
+
+void BVH4Accelerator::build(const vector<Intersectable*>& objects)
+{
+	// Only the binary nodes are collapsed, the leaf packs and compressed
+	// nodes of the binary tree would never be used.
+	BVHAccelerator bvh(splitMethod);
+	bvh.setPackedPrimitives(false);
+	bvh.setQuantizedNodes(false);
+	bvh.build(objects);
+
+	objs = bvh.getObjects();
+	nodes.clear();
+	leaves.clear();
+	treeDepth = 0;
+	if (!bvh.getNodes().empty())
+		collapse(bvh.getNodes(), 0, 0);
+	if (3 * treeDepth + 4 > NodeStack::capacity())
+		throw std::runtime_error("(BVH4Accelerator::build) tree too deep for traversal stack");
+}
+
+/**
+ * Creates a BVH4 node from the binary node at index. The children are
+ * gathered by repeatedly replacing the interior child with the largest
+ * surface area by its two children, until there are four children or
+ * only leaves remain. Returns the index of the new node.
+ */
+int BVH4Accelerator::collapse(const BVHAccelerator::NodeArray& bvh, unsigned int index, int depth)
+{
+	treeDepth = std::max(treeDepth, depth);
+
+	unsigned int slots[4];
+	int n = 0;
+	if (bvh[index].isLeaf())
+		slots[n++] = index;
+	else {
+		slots[n++] = index + 1;
+		slots[n++] = bvh[index].rightChild;
+	}
+
+	while (n < 4) {
+		int best = -1;
+		float bestArea = -1.0f;
+		for (int i = 0; i < n; ++i) {
+			if (bvh[slots[i]].isLeaf())
+				continue;
+			float area = bvh[slots[i]].getAABB().getArea();
+			if (area > bestArea) {
+				bestArea = area;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		unsigned int opened = slots[best];
+		slots[best] = opened + 1;
+		slots[n++] = bvh[opened].rightChild;
+	}
+
+	int nodeIndex = nodes.size();
+	nodes.push_back(BVH4Node());
+
+	// Children are created before the node is filled in, since the
+	// recursion may reallocate the node array.
+	float bbox[6][4];
+	int child[4];
+	for (int i = 0; i < 4; ++i) {
+		if (i >= n) {
+			for (int k = 0; k < 3; ++k) {
+				bbox[k][i] = INF;
+				bbox[k + 3][i] = -INF;
+			}
+			child[i] = 0;
+			continue;
+		}
+
+		const LinearBVHNode& c = bvh[slots[i]];
+		for (int k = 0; k < 3; ++k) {
+			bbox[k][i] = c.bmin[k];
+			bbox[k + 3][i] = c.bmax[k];
+		}
+		if (c.isLeaf()) {
+			BVH4Leaf leaf = { c.primOffset, c.nPrims };
+			child[i] = ~(int)leaves.size();
+			leaves.push_back(leaf);
+		}
+		else
+			child[i] = collapse(bvh, slots[i], depth + 1);
+	}
+
+	BVH4Node& node = nodes[nodeIndex];
+	for (int k = 0; k < 6; ++k)
+		node.bbox[k] = _mm_loadu_ps(bbox[k]);
+	for (int i = 0; i < 4; ++i)
+		node.child[i] = child[i];
+	return nodeIndex;
+}
+
+bool BVH4Accelerator::intersect(const Ray& ray)
+{
+	return findOccluder(ray) != 0;
+}
+
+Intersectable* BVH4Accelerator::findOccluder(const Ray& ray)
+{
+	TraversalStats stats(ray, true);
+	if (nodes.empty())
+		return 0;
+
+	SSERay r(ray);
+	__m128 maxT = _mm_set1_ps(ray.maxT);
+	__m128 tNear;
+	NodeStack nodeStack;
+	nodeStack.push(0);
+
+	while (!nodeStack.empty()) {
+		int index = nodeStack.top();
+		nodeStack.pop();
+		stats.visitNode();
+
+		if (index < 0) {
+			const BVH4Leaf& leaf = leaves[~index];
+			for (unsigned int i = leaf.primOffset; i < leaf.primOffset + leaf.nPrims; ++i) {
+				stats.testPrimitive();
+				if (objs[i]->intersect(ray))
+					return objs[i];
+			}
+			continue;
+		}
+
+		const BVH4Node& node = nodes[index];
+		stats.testBoxes(4);
+		int mask = intersectNode(node, r, maxT, tNear);
+		for (int i = 0; i < 4; ++i) {
+			if (mask & (1 << i))
+				nodeStack.push(node.child[i]);
+		}
+	}
+	return 0;
+}
+
+bool BVH4Accelerator::intersect(const Ray& ray, Intersection& is)
+{
+	TraversalStats stats(ray, false);
+	if (nodes.empty())
+		return false;
+
+	Ray rayCopy(ray);
+	SSERay r(rayCopy);
+	__m128 tNear;
+	bool hit = false;
+	NodeStack nodeStack;
+	nodeStack.push(0);
+
+	while (!nodeStack.empty()) {
+		int index = nodeStack.top();
+		nodeStack.pop();
+		stats.visitNode();
+
+		if (index < 0) {
+			const BVH4Leaf& leaf = leaves[~index];
+			for (unsigned int i = leaf.primOffset; i < leaf.primOffset + leaf.nPrims; ++i) {
+				stats.testPrimitive();
+				if (objs[i]->intersect(rayCopy, is)) {
+					rayCopy.maxT = is.mHitTime;
+					hit = true;
+				}
+			}
+			continue;
+		}
+
+		const BVH4Node& node = nodes[index];
+		stats.testBoxes(4);
+		int mask = intersectNode(node, r, _mm_set1_ps(rayCopy.maxT), tNear);
+		if (!mask)
+			continue;
+
+		// Push the hit children farthest first, so the nearest is visited next.
+		float t[4];
+		_mm_storeu_ps(t, tNear);
+		int order[4];
+		int count = 0;
+		for (int i = 0; i < 4; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+			int j = count++;
+			while (j > 0 && t[order[j - 1]] < t[i]) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = i;
+		}
+		for (int j = 0; j < count; ++j)
+			nodeStack.push(node.child[order[j]]);
+	}
+	return hit;
+}
@@ -0,0 +1,59 @@
+/*
+*  bvh4accelerator.h
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#ifndef BVH4ACCELERATOR_H
+#define BVH4ACCELERATOR_H
+
+#include <xmmintrin.h>
+#include "rayaccelerator.h"
+#include "bvhaccelerator.h"
+#include "alignedallocator.h"
+
+/**
+ * Four-wide BVH node. The boxes of the four children are stored in
+ * structure-of-arrays layout, so one ray can be tested against all of
+ * them with a single SSE slab test. Unused child slots have an inverted
+ * (empty) box and are never reported as hit.
+ */
+struct BVH4Node {
+	__m128 bbox[6];		///< minx, miny, minz, maxx, maxy, maxz of the four children.
+	int child[4];		///< >= 0: index of child node, < 0: ~index of leaf.
+};
+
+/// Primitive range referenced by a leaf slot in a BVH4Node.
+struct BVH4Leaf {
+	unsigned int primOffset;
+	unsigned int nPrims;
+};
+
+/**
+ * Ray accelerator using a four-wide BVH. The tree is built by collapsing
+ * a binary BVH built by BVHAccelerator, pulling up grandchildren until
+ * each node has up to four children.
+ */
+class BVH4Accelerator : public RayAccelerator
+{
+private:
+	std::vector<Intersectable*> objs;
+	std::vector<BVH4Node, AlignedAllocator<BVH4Node, 64> > nodes;
+	std::vector<BVH4Leaf> leaves;
+	BVHAccelerator::SplitMethod splitMethod;
+	int treeDepth;		///< Depth of the deepest node in the current tree.
+
+	int collapse(const BVHAccelerator::NodeArray& bvh, unsigned int index, int depth);
+
+public:
+	BVH4Accelerator(BVHAccelerator::SplitMethod method = BVHAccelerator::SPLIT_SAH);
+
+	virtual void build(const std::vector<Intersectable*>& objects);
+	virtual bool intersect(const Ray& ray);
+	virtual Intersectable* findOccluder(const Ray& ray);
+	virtual bool intersect(const Ray& ray, Intersection& is);
+};
+
+#endif
@@ -5,216 +5,1622 @@
 */
 
 #include "bvhaccelerator.h"
+#include "traversalstack.h"
+#include "morton.h"
+#include "raystats.h"
+#include "mappedfile.h"
 #include <algorithm> 
 #include <iomanip>
-#include <stack>
+#include <fstream>
+#include <cstring>
+#include <unordered_map>
 
 using namespace std;
 
-class ComparePrimitives {
-public:
-	bool operator() (Intersectable *a, Intersectable *b) {
-		AABB box;
-		a->getAABB(box);
-		float ca = (box.mMax(sort_dim) + box.mMin(sort_dim)) * 0.5f;
-		b->getAABB(box);
-		float cb = (box.mMax(sort_dim) + box.mMin(sort_dim)) * 0.5f;
-		return ca < cb;
-	}
+/// Primitive count at or below which the midpoint and Morton builders stop splitting.
+static const int midpointLeafSize = 3;
+/// Largest leaf the SAH builder is allowed to create when splitting is not worth it.
+static const int sahMaxLeafSize = 8;
+/// Number of centroid bins evaluated per node by the SAH builder.
+static const int sahBins = 16;
+/// Cost of traversing an interior node, relative to one primitive test.
+static const float sahTraversalCost = 0.125f;
+/// Primitive count above which the build is split into parallel tasks.
+static const int parallelBuildThreshold = 4096;
+/// Number of leading Morton code bits that select an HLBVH treelet.
+static const int hlbvhTreeletBits = 12;
+/// Child overlap, relative to the root area, above which the SBVH builder tries spatial splits.
+static const float sbvhOverlapThreshold = 1e-5f;
+
+// Task parallel construction needs OpenMP 3.0, older versions
+// (such as Visual C++) build the tree serially.
+#if defined(_OPENMP) && _OPENMP >= 200805
+#define BVH_PARALLEL_BUILD
+#endif
+
+/// Stack entry of the closest-hit traversal.
+struct StackItem{
+	unsigned int node;
+	float t;
+};
+
+// A depth-first traversal of a binary tree never holds more than one
+// pending sibling per level, plus the node being processed.
+typedef TraversalStack<unsigned int, BVHAccelerator::maxDepth + 1> NodeStack;
+typedef TraversalStack<StackItem, BVHAccelerator::maxDepth + 1> OrderedNodeStack;
 
-	int sort_dim;
+/// Stack entry of the compressed traversals, with the node's decoded box
+/// that its children are decoded from.
+struct QuantizedStackItem{
+	unsigned int node;
+	float t;
+	float box[6];
 };
 
+typedef TraversalStack<QuantizedStackItem, BVHAccelerator::maxDepth + 1> QuantizedNodeStack;
+
+/// Stack entry of the packet traversals, with the first ray of the packet
+/// that may still hit the node. Rays before it missed an ancestor.
+struct PacketStackItem{
+	unsigned int node;
+	int first;
+};
+
+typedef TraversalStack<PacketStackItem, BVHAccelerator::maxDepth + 1> PacketNodeStack;
+
+BVHAccelerator::BVHAccelerator(SplitMethod method) : splitMethod(method), treeDepth(0),
+	builtCost(0.0f), refitThreshold(1.5f), referenceBudget(0.3f), referencesLeft(0), rootArea(0.0f),
+	useQuantizedNodes(false), usePackedPrimitives(true)
+{
+}
 
 void BVHAccelerator::build(const vector<Intersectable*>& objects)
 {
-	AABB worldBox;
-	for (Intersectable* o : objects){
-		AABB temp;
-		o->getAABB(temp);
-		worldBox.include(temp);
-		objs.push_back(o);
-	}
-	root = new BVHNode();
-	root->setAABB(worldBox);
-	nodes.push_back(root);
-	build_recursive(0, objs.size(), root, 0);
+	// Cache the bounds and centroid of every primitive once, so the builder
+	// never has to go through the virtual getAABB() again.
+	int count = (int)objects.size();
+	prims.resize(count);
+	#pragma omp parallel for if(count >= parallelBuildThreshold)
+	for (int i = 0; i < count; ++i){
+		PrimitiveInfo& p = prims[i];
+		p.obj = objects[i];
+		p.obj->getAABB(p.bbox);
+		for (int k = 0; k < 3; ++k)
+			p.centroid(k) = (p.bbox.mMin(k) + p.bbox.mMax(k)) * 0.5f;
+	}
+
+	// Spatial split boxes depend on the geometry inside the primitive
+	// bounds, which the cache key does not cover, so SBVH trees are not cached.
+	bool useCache = !cacheFile.empty() && splitMethod != SPLIT_SBVH;
+	unsigned long long key = 0;
+	if (useCache){
+		key = cacheKey();
+		if (loadCache(key, objects)){
+			vector<PrimitiveInfo>().swap(prims);
+			buildPackedPrimitives();
+			buildQuantizedNodes();
+			return;
+		}
+	}
+
+	AABB worldBox, centroidBox;
+	#pragma omp parallel if(count >= parallelBuildThreshold)
+	{
+		AABB threadBox, threadCentroids;
+		#pragma omp for nowait
+		for (int i = 0; i < count; ++i){
+			threadBox.include(prims[i].bbox);
+			threadCentroids.include(prims[i].centroid);
+		}
+		#pragma omp critical
+		{
+			worldBox.include(threadBox);
+			centroidBox.include(threadCentroids);
+		}
+	}
+
+	if (splitMethod == SPLIT_LBVH || splitMethod == SPLIT_HLBVH)
+		sortMorton(centroidBox);
+
+	nodes.clear();
+	treeDepth = 0;
+	rootArea = worldBox.getArea();
+	if (splitMethod == SPLIT_SBVH){
+		// The spatial split builder emits the leaf references into objs
+		// itself, it runs serially since the reference count is shared.
+		objs.clear();
+		referencesLeft = (int)(count * referenceBudget);
+		if (!prims.empty())
+			treeDepth = build_sbvh(0, worldBox, 0, nodes);
+	}
+	else{
+		if (!prims.empty()){
+#ifdef BVH_PARALLEL_BUILD
+			#pragma omp parallel
+			#pragma omp single
+#endif
+			treeDepth = build_recursive(0, count, worldBox, 0, nodes);
+		}
+
+		// The builder reorders prims, the leaves index into objs in the same order.
+		objs.resize(prims.size());
+		for (size_t i = 0; i < prims.size(); ++i)
+			objs[i] = prims[i].obj;
+	}
+	if (treeDepth + 1 > NodeStack::capacity())
+		throw std::runtime_error("(BVHAccelerator::build) tree too deep for traversal stack");
+	vector<PrimitiveInfo>().swap(prims);
+	builtCost = getStatistics().sahCost;
+	if (useCache)
+		saveCache(key, objects);
+	buildPackedPrimitives();
+	buildQuantizedNodes();
 	//print();
 }
-void BVHAccelerator::build_recursive(int left_index, int right_index, BVHNode* node, int depth){
-	if ((right_index - left_index) <= 3 || depth == 20){// || (other termination criteria)){
-		node->makeLeaf(left_index, right_index - left_index );
+
+/// Header of the on-disk tree cache. It is followed by the nodes, starting
+/// at a 64 byte boundary, and then by one 32-bit object index per leaf reference.
+struct BVHCacheHeader {
+	char magic[8];					///< "PRBVH" and a zero terminator.
+	unsigned int version;			///< Bumped whenever the file layout changes.
+	unsigned int nodeSize;			///< sizeof(LinearBVHNode) of the writer.
+	unsigned long long key;			///< Hash of the primitive bounds and build settings.
+	unsigned int objectCount;		///< Number of primitives the tree was built over.
+	unsigned int nodeCount;
+	unsigned int referenceCount;	///< Number of leaf references, larger than objectCount for SBVH.
+	int depth;						///< Depth of the deepest leaf.
+	float builtCost;				///< SAH cost of the tree.
+	unsigned char pad[20];			///< Padding up to 64 bytes.
+};
+
+static_assert(sizeof(BVHCacheHeader) == 64, "BVHCacheHeader must be 64 bytes");
+
+static const char bvhCacheMagic[8] = { 'P', 'R', 'B', 'V', 'H', 0, 0, 0 };
+static const unsigned int bvhCacheVersion = 1;
+
+/// Folds len bytes at data into the 64-bit FNV-1a hash h.
+static unsigned long long hashBytes(unsigned long long h, const void* data, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < len; ++i){
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/**
+ * Returns the cache key of the current build: a hash of the split method,
+ * the builder settings and the bounds of every primitive in input order.
+ * Trees built without spatial splits only depend on these, so a change to
+ * any mesh file or transform that moves a primitive gives a new key. SBVH
+ * trees also depend on the geometry inside the bounds and are not cached.
+ */
+unsigned long long BVHAccelerator::cacheKey() const
+{
+	unsigned long long h = 14695981039346656037ull;
+	int method = (int)splitMethod;
+	unsigned int count = (unsigned int)prims.size();
+	h = hashBytes(h, &method, sizeof(method));
+	h = hashBytes(h, &referenceBudget, sizeof(referenceBudget));
+	h = hashBytes(h, &count, sizeof(count));
+	for (size_t i = 0; i < prims.size(); ++i){
+		float b[6];
+		for (int k = 0; k < 3; ++k){
+			b[k] = prims[i].bbox.mMin(k);
+			b[k + 3] = prims[i].bbox.mMax(k);
+		}
+		h = hashBytes(h, b, sizeof(b));
+	}
+	return h;
+}
+
+/**
+ * Maps the cache file and, if it holds a tree with the given key, copies
+ * the nodes and resolves the leaf references to objects. Returns false if
+ * the file is missing, stale or damaged, the tree is then left empty.
+ * The key is computed from the loaded primitives, so the cache saves the
+ * tree build but not the loading of the scene files.
+ */
+bool BVHAccelerator::loadCache(unsigned long long key, const vector<Intersectable*>& objects)
+{
+	MappedFile file;
+	if (!file.open(cacheFile) || file.size() < sizeof(BVHCacheHeader))
+		return false;
+
+	BVHCacheHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic)) != 0 || header.version != bvhCacheVersion ||
+		header.nodeSize != sizeof(LinearBVHNode) || header.key != key || header.objectCount != objects.size() ||
+		header.depth + 1 > NodeStack::capacity())
+		return false;
+
+	size_t nodeBytes = (size_t)header.nodeCount * sizeof(LinearBVHNode);
+	size_t indexBytes = (size_t)header.referenceCount * sizeof(unsigned int);
+	if (file.size() != sizeof(header) + nodeBytes + indexBytes)
+		return false;
+
+	const unsigned char* p = file.data() + sizeof(header);
+	nodes.resize(header.nodeCount);
+	if (nodeBytes)
+		memcpy(&nodes[0], p, nodeBytes);
+	p += nodeBytes;
+
+	// The children of a node follow it in depth-first order, so the links
+	// and depths can be checked in one forward pass. Rejects links and leaf
+	// ranges out of bounds, and trees deeper than the header says.
+	vector<unsigned int> depths(header.nodeCount, 0);
+	for (unsigned int i = 0; i < header.nodeCount; ++i){
+		const LinearBVHNode& node = nodes[i];
+		bool valid;
+		if (node.isLeaf())
+			valid = (unsigned long long)node.primOffset + node.nPrims <= header.referenceCount;
+		else
+			valid = i + 1 < header.nodeCount && node.rightChild > i + 1 && node.rightChild < header.nodeCount &&
+				(int)depths[i] + 1 <= header.depth;
+		if (!valid){
+			nodes.clear();
+			return false;
+		}
+		if (!node.isLeaf())
+			depths[i + 1] = depths[node.rightChild] = depths[i] + 1;
+	}
+
+	objs.resize(header.referenceCount);
+	for (unsigned int i = 0; i < header.referenceCount; ++i){
+		unsigned int index;
+		memcpy(&index, p + i * sizeof(index), sizeof(index));
+		if (index >= objects.size()){
+			nodes.clear();
+			objs.clear();
+			return false;
+		}
+		objs[i] = objects[index];
+	}
+	treeDepth = header.depth;
+	builtCost = header.builtCost;
+	return true;
+}
+
+/**
+ * Writes the current tree to the cache file, the leaf references are
+ * stored as indices into objects. Failing to write is not an error, the
+ * tree is simply built again next time.
+ */
+void BVHAccelerator::saveCache(unsigned long long key, const vector<Intersectable*>& objects) const
+{
+	unordered_map<const Intersectable*, unsigned int> indices;
+	indices.reserve(objects.size());
+	for (size_t i = 0; i < objects.size(); ++i)
+		indices[objects[i]] = (unsigned int)i;
+
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic));
+	header.version = bvhCacheVersion;
+	header.nodeSize = sizeof(LinearBVHNode);
+	header.key = key;
+	header.objectCount = (unsigned int)objects.size();
+	header.nodeCount = (unsigned int)nodes.size();
+	header.referenceCount = (unsigned int)objs.size();
+	header.depth = treeDepth;
+	header.builtCost = builtCost;
+
+	vector<unsigned int> references(objs.size());
+	for (size_t i = 0; i < objs.size(); ++i)
+		references[i] = indices[objs[i]];
+
+	ofstream out(cacheFile.c_str(), ios::binary | ios::trunc);
+	out.write((const char*)&header, sizeof(header));
+	if (!nodes.empty())
+		out.write((const char*)&nodes[0], nodes.size() * sizeof(LinearBVHNode));
+	if (!references.empty())
+		out.write((const char*)&references[0], references.size() * sizeof(unsigned int));
+	if (!out)
+		cerr << "(BVHAccelerator::saveCache) could not write " << cacheFile << endl;
+}
+
+/**
+ * Recomputes the node boxes bottom-up from the current primitive bounds,
+ * keeping the topology of the tree. The nodes are stored depth-first, so
+ * the children of a node always come after it and a reverse sweep over the
+ * array visits them first. If the SAH cost of the refitted tree has grown
+ * past the refit threshold, or the tree has spatial splits whose clipped
+ * references can not be refitted, the tree is rebuilt instead.
+ */
+void BVHAccelerator::refit(const vector<Intersectable*>& objects)
+{
+	if (splitMethod == SPLIT_SBVH || objects.size() != objs.size() || nodes.empty()){
+		build(objects);
 		return;
 	}
-	ComparePrimitives cmp;
-	int largestAxis = node->getAABB().getLargestAxis();
-	cmp.sort_dim = largestAxis;
-	sort(objs.begin() + left_index, objs.begin() + right_index, cmp);
-	float split;
-	float currentMid;
-	
-	//node->getAABB().mMax(largestAxis);
-
-	if (largestAxis == 0){
-		split = (node->getAABB().mMax.x + node->getAABB().mMin.x) / 2.0f;
-		currentMid = node->getAABB().mMin.x;
-	}
-	else if (largestAxis == 1){
-		split = (node->getAABB().mMax.y + node->getAABB().mMin.y) / 2.0f;
-		currentMid = node->getAABB().mMin.y;
-	}else{
-		split = (node->getAABB().mMax.z + node->getAABB().mMin.z) / 2.0f;
-		currentMid = node->getAABB().mMin.z;
-	}
-
-	int split_index = left_index;
-	AABB aabb;
-	while (currentMid < split && split_index < right_index){
-		objs[split_index]->getAABB(aabb);
-		if (largestAxis == 0){
-			currentMid = (aabb.mMax.x + aabb.mMin.x) / 2.0f;
-		}
-		else if (largestAxis == 1){
-			currentMid = (aabb.mMax.y + aabb.mMin.y) / 2.0f;
+
+	int count = (int)nodes.size();
+	#pragma omp parallel for if(count >= parallelBuildThreshold)
+	for (int i = 0; i < count; ++i){
+		LinearBVHNode& node = nodes[i];
+		if (!node.isLeaf())
+			continue;
+		AABB box, primBox;
+		for (unsigned int k = node.primOffset; k < node.primOffset + node.nPrims; ++k){
+			objs[k]->getAABB(primBox);
+			box.include(primBox);
+		}
+		node.setAABB(box);
+	}
+
+	float cost = 0.0f;
+	for (int i = count - 1; i >= 0; --i){
+		LinearBVHNode& node = nodes[i];
+		if (node.isLeaf()){
+			cost += node.nPrims * node.getAABB().getArea();
+			continue;
 		}
-		else{
-			currentMid = (aabb.mMax.z + aabb.mMin.z) / 2.0f;
+		AABB box = nodes[i + 1].getAABB();
+		box.include(nodes[node.rightChild].getAABB());
+		node.setAABB(box);
+		cost += sahTraversalCost * box.getArea();
+	}
+	cost /= nodes[0].getAABB().getArea();
+
+	if (cost > builtCost * refitThreshold)
+		build(objects);
+	else{
+		buildPackedPrimitives();
+		buildQuantizedNodes();
+	}
+}
+
+/**
+ * Sorts the primitives of each leaf into triangles, spheres with a world-space
+ * form and everything else, and copies the first two groups into the typed
+ * arrays: the triangles packed four by four, the spheres as WorldSpheres.
+ * Frees the arrays if they are not used. The number of triangles and spheres
+ * is kept in the leaf's otherwise unused axis and nSpheres fields, so this
+ * must run before buildQuantizedNodes() copies the nodes.
+ */
+void BVHAccelerator::buildPackedPrimitives()
+{
+	packs.clear();
+	spheres.clear();
+	leafOffsets.clear();
+	if (!usePackedPrimitives || nodes.empty()){
+		vector<TrianglePack, AlignedAllocator<TrianglePack, 64> >().swap(packs);
+		vector<WorldSphere>().swap(spheres);
+		vector<LeafOffsets>().swap(leafOffsets);
+		return;
+	}
+
+	leafOffsets.resize(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i){
+		LinearBVHNode& node = nodes[i];
+		node.nSpheres = 0;
+		if (!node.isLeaf())
+			continue;
+
+		vector<Intersectable*>::iterator first = objs.begin() + node.primOffset;
+		vector<Intersectable*>::iterator last = first + node.nPrims;
+		vector<Intersectable*>::iterator triEnd = stable_partition(first, last,
+			[](Intersectable* obj) { return dynamic_cast<Triangle*>(obj) != 0; });
+		unsigned int nTris = std::min((unsigned int)(triEnd - first), 255u);
+
+		WorldSphere ws;
+		vector<Intersectable*>::iterator sphereEnd = stable_partition(first + nTris, last,
+			[&ws](Intersectable* obj) { Sphere* s = dynamic_cast<Sphere*>(obj); return s && s->getWorldSphere(ws); });
+		unsigned int nSpheres = std::min((unsigned int)(sphereEnd - first) - nTris, 255u);
+
+		leafOffsets[i].pack = (unsigned int)packs.size();
+		for (unsigned int j = 0; j < nTris; j += 4){
+			TrianglePack pack;
+			pack.clear();
+			for (unsigned int lane = 0; lane < 4 && j + lane < nTris; ++lane)
+				pack.set(lane, static_cast<Triangle*>(objs[node.primOffset + j + lane]));
+			packs.push_back(pack);
+		}
+
+		leafOffsets[i].sphere = (unsigned int)spheres.size();
+		for (unsigned int j = 0; j < nSpheres; ++j){
+			static_cast<Sphere*>(objs[node.primOffset + nTris + j])->getWorldSphere(ws);
+			spheres.push_back(ws);
+		}
+		node.axis = (unsigned char)nTris;
+		node.nSpheres = (unsigned char)nSpheres;
+	}
+}
+
+/**
+ * Makes the compressed copy of the node array, or frees it if compressed
+ * nodes are not used. The boxes are encoded top-down, each one relative
+ * to the decoded box of its parent, i.e. the box the traversal will see
+ * rather than the exact one. Parents come before their children in the
+ * depth-first order, so one forward pass suffices.
+ */
+void BVHAccelerator::buildQuantizedNodes()
+{
+	if (!useQuantizedNodes || nodes.empty()){
+		QuantizedNodeArray().swap(qnodes);
+		return;
+	}
+
+	size_t count = nodes.size();
+	qnodes.resize(count);
+	vector<float> decoded(count * 6);
+	for (int k = 0; k < 3; ++k){
+		rootBox[k] = decoded[k] = nodes[0].bmin[k];
+		rootBox[k + 3] = decoded[k + 3] = nodes[0].bmax[k];
+	}
+	qnodes[0].encode(rootBox, rootBox);
+
+	for (size_t i = 0; i < count; ++i){
+		const LinearBVHNode& node = nodes[i];
+		QuantizedBVHNode& q = qnodes[i];
+		q.nPrims = node.nPrims;
+		q.primOffset = node.primOffset;
+		q.axis = node.axis;
+		q.nSpheres = node.nSpheres;
+		q.pad[0] = q.pad[1] = 0;
+		if (node.isLeaf())
+			continue;
+
+		unsigned int children[2] = { (unsigned int)i + 1, node.rightChild };
+		for (int c = 0; c < 2; ++c){
+			const LinearBVHNode& child = nodes[children[c]];
+			float box[6] = { child.bmin[0], child.bmin[1], child.bmin[2], child.bmax[0], child.bmax[1], child.bmax[2] };
+			qnodes[children[c]].encode(&decoded[i * 6], box);
+			qnodes[children[c]].decode(&decoded[i * 6], &decoded[children[c] * 6]);
 		}
-		++split_index;
 	}
-	//--split_index;
+}
 
-	if (split_index == left_index)
-		++split_index;
-	if (split_index == right_index)
-		--split_index;
+/**
+ * Appends the subtree for primitives [left_index,right_index) to the node
+ * array out. The node itself is emitted first, followed by the complete left
+ * subtree and then the right subtree. Large subtrees are built as parallel
+ * tasks into separate arrays, which are then spliced into out.
+ * Returns the depth of the deepest leaf in the subtree.
+ */
+int BVHAccelerator::build_recursive(int left_index, int right_index, const AABB& bbox, int depth, NodeArray& out){
+	unsigned int index = out.size();
+	out.push_back(LinearBVHNode());
+	out[index].setAABB(bbox);
 
-	//find split_index
+	int n = right_index - left_index;
+	int leafSize = (splitMethod == SPLIT_SAH) ? 1 : midpointLeafSize;
+	int split_index = -1;
+	int axis = 0;
+	if (n > leafSize && depth < maxDepth){
+		switch (splitMethod){
+		case SPLIT_MIDPOINT:
+			split_index = splitMidpoint(left_index, right_index, bbox, axis);
+			break;
+		case SPLIT_SAH:
+			split_index = splitSAH(left_index, right_index, bbox, axis);
+			break;
+		case SPLIT_LBVH:
+			split_index = splitMorton(left_index, right_index, axis);
+			break;
+		case SPLIT_HLBVH:
+			// Ranges spanning several treelets are split by SAH, below that
+			// the Morton order already defines the hierarchy.
+			if (highestDifferingBit(prims[left_index].morton, prims[right_index - 1].morton) >= 3 * mortonBitsPerAxis - hlbvhTreeletBits)
+				split_index = splitSAH(left_index, right_index, bbox, axis);
+			else
+				split_index = splitMorton(left_index, right_index, axis);
+			break;
+		case SPLIT_SBVH:
+			// Spatial split trees are built by build_sbvh().
+			throw std::runtime_error("(BVHAccelerator::build_recursive) SBVH builds do not use this builder");
+		}
+	}
+
+	// The SAH builder returns -1 when a leaf is cheaper than any split.
+	if (split_index < 0){
+		if (n > 0xffff)
+			throw std::runtime_error("(BVHAccelerator::build_recursive) too many primitives in leaf");
+		out[index].primOffset = left_index;
+		out[index].nPrims = (unsigned short)n;
+		return depth;
+	}
 
 	//calculate bounding boxes for left and right sides
-	AABB left;
-	for (int i = left_index; i < split_index; ++i){
-		objs[i]->getAABB(aabb);
-		left.include(aabb);
+	AABB left, right, centroids;
+	computeBounds(left_index, split_index, left, centroids);
+	computeBounds(split_index, right_index, right, centroids);
+
+	out[index].axis = (unsigned char)axis;
+	out[index].nPrims = 0;
+
+	int leftDepth, rightDepth;
+#ifdef BVH_PARALLEL_BUILD
+	if (n >= parallelBuildThreshold){
+		NodeArray leftNodes, rightNodes;
+		#pragma omp task shared(leftNodes, left, leftDepth)
+		leftDepth = build_recursive(left_index, split_index, left, depth + 1, leftNodes);
+		#pragma omp task shared(rightNodes, right, rightDepth)
+		rightDepth = build_recursive(split_index, right_index, right, depth + 1, rightNodes);
+		#pragma omp taskwait
+
+		appendSubtree(out, leftNodes);
+		out[index].rightChild = out.size();
+		appendSubtree(out, rightNodes);
+		return std::max(leftDepth, rightDepth);
+	}
+#endif
+	leftDepth = build_recursive(left_index, split_index, left, depth + 1, out);
+	out[index].rightChild = out.size();
+	rightDepth = build_recursive(split_index, right_index, right, depth + 1, out);
+	return std::max(leftDepth, rightDepth);
+}
+
+/**
+ * Appends a subtree built into a separate array to out, offsetting the
+ * right child indices of its interior nodes.
+ */
+void BVHAccelerator::appendSubtree(NodeArray& out, const NodeArray& subtree)
+{
+	unsigned int offset = out.size();
+	out.insert(out.end(), subtree.begin(), subtree.end());
+	for (size_t i = offset; i < out.size(); ++i){
+		if (!out[i].isLeaf())
+			out[i].rightChild += offset;
+	}
+}
+
+/**
+ * Computes the union of the primitive boxes and of the primitive centroids
+ * in [left_index,right_index). Near the top of the tree the range is split
+ * into chunks that are processed as parallel tasks.
+ */
+void BVHAccelerator::computeBounds(int left_index, int right_index, AABB& bbox, AABB& centroidBox) const
+{
+	bbox = AABB();
+	centroidBox = AABB();
+#ifdef BVH_PARALLEL_BUILD
+	if (right_index - left_index >= parallelBuildThreshold){
+		const int chunks = 16;
+		AABB chunkBox[chunks], chunkCentroids[chunks];
+		int chunkSize = (right_index - left_index + chunks - 1) / chunks;
+		for (int c = 0; c < chunks; ++c){
+			#pragma omp task shared(chunkBox, chunkCentroids) firstprivate(c)
+			{
+				int end = std::min(left_index + (c + 1) * chunkSize, right_index);
+				for (int i = left_index + c * chunkSize; i < end; ++i){
+					chunkBox[c].include(prims[i].bbox);
+					chunkCentroids[c].include(prims[i].centroid);
+				}
+			}
+		}
+		#pragma omp taskwait
+		for (int c = 0; c < chunks; ++c){
+			bbox.include(chunkBox[c]);
+			centroidBox.include(chunkCentroids[c]);
+		}
+		return;
+	}
+#endif
+	for (int i = left_index; i < right_index; ++i){
+		bbox.include(prims[i].bbox);
+		centroidBox.include(prims[i].centroid);
+	}
+}
+
+/**
+ * Partitions the primitives around the spatial midpoint of the largest
+ * axis of the node's box. Falls back to a median split if all centroids
+ * end up on the same side. Returns the index of the first right primitive
+ * and the split axis in axis.
+ */
+int BVHAccelerator::splitMidpoint(int left_index, int right_index, const AABB& bbox, int& axis)
+{
+	axis = bbox.getLargestAxis();
+	float split = (bbox.mMax(axis) + bbox.mMin(axis)) * 0.5f;
+
+	vector<PrimitiveInfo>::iterator first = prims.begin() + left_index;
+	vector<PrimitiveInfo>::iterator last = prims.begin() + right_index;
+	vector<PrimitiveInfo>::iterator mid = partition(first, last,
+		[axis, split](const PrimitiveInfo& p) { return p.centroid(axis) < split; });
+
+	if (mid == first || mid == last){
+		mid = first + (right_index - left_index) / 2;
+		nth_element(first, mid, last,
+			[axis](const PrimitiveInfo& a, const PrimitiveInfo& b) { return a.centroid(axis) < b.centroid(axis); });
+	}
+	return (int)(mid - prims.begin());
+}
+
+/**
+ * Finds the cheapest split according to the surface area heuristic.
+ * Returns the index of the first right primitive, or -1 if the primitives
+ * should be kept in a leaf. The chosen axis is returned in axis.
+ */
+int BVHAccelerator::splitSAH(int left_index, int right_index, const AABB& bbox, int& axis)
+{
+	int n = right_index - left_index;
+
+	SplitCandidate split;
+	bool binned = findObjectSplit(left_index, right_index, bbox, split);
+	axis = split.axis;
+
+	// All centroids coincide, binning cannot separate them.
+	if (!binned){
+		if (n <= sahMaxLeafSize)
+			return -1;
+		return left_index + n / 2;
+	}
+
+	if (split.cost == INF || (n <= sahMaxLeafSize && split.cost >= (float)n))
+		return -1;
+	return partitionObjectSplit(left_index, right_index, split);
+}
+
+/**
+ * Evaluates the object splits of the primitives in [left_index,right_index).
+ * The centroids are binned along the largest axis of their bounds and the
+ * cost of splitting between each pair of adjacent bins is evaluated.
+ * Returns false, with only split.axis set, if all centroids coincide.
+ */
+bool BVHAccelerator::findObjectSplit(int left_index, int right_index, const AABB& bbox, SplitCandidate& split) const
+{
+	AABB primBox, centroidBox;
+	computeBounds(left_index, right_index, primBox, centroidBox);
+	int axis = centroidBox.getLargestAxis();
+	float cmin = centroidBox.mMin(axis);
+	float extent = centroidBox.mMax(axis) - cmin;
+
+	split.cost = INF;
+	split.axis = axis;
+	if (extent <= 0.0f)
+		return false;
+
+	struct Bin {
+		AABB bbox;
+		int count;
+	};
+	Bin bins[sahBins];
+	for (int b = 0; b < sahBins; ++b)
+		bins[b].count = 0;
+
+	float scale = sahBins / extent;
+	for (int i = left_index; i < right_index; ++i){
+		int b = std::min((int)((prims[i].centroid(axis) - cmin) * scale), sahBins - 1);
+		bins[b].count++;
+		bins[b].bbox.include(prims[i].bbox);
+	}
+
+	// Sweep from the right to get the box and count of every right side,
+	// then from the left evaluating the cost of each split plane.
+	AABB rightBox[sahBins - 1];
+	int rightCount[sahBins - 1];
+	AABB acc;
+	int count = 0;
+	for (int b = sahBins - 1; b > 0; --b){
+		acc.include(bins[b].bbox);
+		count += bins[b].count;
+		rightBox[b - 1] = acc;
+		rightCount[b - 1] = count;
+	}
+
+	float bestCost = INF;
+	acc = AABB();
+	count = 0;
+	for (int b = 0; b < sahBins - 1; ++b){
+		acc.include(bins[b].bbox);
+		count += bins[b].count;
+		if (count == 0 || rightCount[b] == 0)
+			continue;
+		float cost = count * acc.getArea() + rightCount[b] * rightBox[b].getArea();
+		if (cost < bestCost){
+			bestCost = cost;
+			split.bin = b;
+			split.leftCount = count;
+			split.rightCount = rightCount[b];
+			split.leftBox = acc;
+			split.rightBox = rightBox[b];
+		}
+	}
+
+	if (bestCost < INF)
+		split.cost = sahTraversalCost + bestCost / bbox.getArea();
+	split.binMin = cmin;
+	split.binScale = scale;
+	return true;
+}
+
+/**
+ * Partitions the primitives according to an object split found by
+ * findObjectSplit(). Returns the index of the first right primitive.
+ */
+int BVHAccelerator::partitionObjectSplit(int left_index, int right_index, const SplitCandidate& split)
+{
+	int axis = split.axis;
+	float cmin = split.binMin;
+	float scale = split.binScale;
+	int bestSplit = split.bin;
+	auto inLeft = [=](const PrimitiveInfo& p) {
+		int b = std::min((int)((p.centroid(axis) - cmin) * scale), sahBins - 1);
+		return b <= bestSplit;
+	};
+	// The HLBVH treelets below this node rely on the Morton order being kept.
+	vector<PrimitiveInfo>::iterator mid = (splitMethod == SPLIT_HLBVH) ?
+		stable_partition(prims.begin() + left_index, prims.begin() + right_index, inLeft) :
+		partition(prims.begin() + left_index, prims.begin() + right_index, inLeft);
+	return (int)(mid - prims.begin());
+}
+
+/**
+ * Evaluates spatial splits of the references in [left_index,right_index).
+ * The largest axis of the node's box is divided into equally sized bins,
+ * and each reference is clipped into every bin it overlaps. A reference
+ * is counted on the left side of a plane if it starts before it, and on
+ * the right side if it ends after it, so straddling references count
+ * on both sides.
+ */
+void BVHAccelerator::findSpatialSplit(int left_index, int right_index, const AABB& bbox, SplitCandidate& split) const
+{
+	int axis = bbox.getLargestAxis();
+	float bmin = bbox.mMin(axis);
+	float extent = bbox.mMax(axis) - bmin;
+
+	split.cost = INF;
+	split.axis = axis;
+	split.leftCount = split.rightCount = 0;
+	if (extent <= 0.0f)
+		return;
+
+	struct Bin {
+		AABB bbox;
+		int entries;
+		int exits;
+	};
+	Bin bins[sahBins];
+	for (int b = 0; b < sahBins; ++b)
+		bins[b].entries = bins[b].exits = 0;
+
+	float scale = sahBins / extent;
+	float binSize = extent / sahBins;
+	for (int i = left_index; i < right_index; ++i){
+		const PrimitiveInfo& p = prims[i];
+		int first = std::max(std::min((int)((p.bbox.mMin(axis) - bmin) * scale), sahBins - 1), 0);
+		int last = std::max(std::min((int)((p.bbox.mMax(axis) - bmin) * scale), sahBins - 1), first);
+		bins[first].entries++;
+		bins[last].exits++;
+
+		AABB rest = p.bbox;
+		for (int b = first; b < last; ++b){
+			AABB left, right;
+			p.obj->splitAABB(axis, bmin + (b + 1) * binSize, left, right);
+			left.clip(rest);
+			right.clip(rest);
+			bins[b].bbox.include(left);
+			rest = right;
+		}
+		bins[last].bbox.include(rest);
+	}
+
+	AABB rightBox[sahBins - 1];
+	int rightCount[sahBins - 1];
+	AABB acc;
+	int count = 0;
+	for (int b = sahBins - 1; b > 0; --b){
+		acc.include(bins[b].bbox);
+		count += bins[b].exits;
+		rightBox[b - 1] = acc;
+		rightCount[b - 1] = count;
+	}
+
+	float bestCost = INF;
+	acc = AABB();
+	count = 0;
+	for (int b = 0; b < sahBins - 1; ++b){
+		acc.include(bins[b].bbox);
+		count += bins[b].entries;
+		if (count == 0 || rightCount[b] == 0)
+			continue;
+		float cost = count * acc.getArea() + rightCount[b] * rightBox[b].getArea();
+		if (cost < bestCost){
+			bestCost = cost;
+			split.position = bmin + (b + 1) * binSize;
+			split.leftCount = count;
+			split.rightCount = rightCount[b];
+			split.leftBox = acc;
+			split.rightBox = rightBox[b];
+		}
+	}
+
+	if (bestCost < INF)
+		split.cost = sahTraversalCost + bestCost / bbox.getArea();
+}
+
+/**
+ * Spatial split BVH builder. The references of the node are the range
+ * [left_index,prims.size()) at the end of prims, so that spatial splits can
+ * grow the number of references. The left child's references are built
+ * first, while the right child's are kept aside. Leaves append their
+ * primitives to objs and remove their references from prims.
+ * Returns the depth of the deepest leaf in the subtree.
+ */
+int BVHAccelerator::build_sbvh(int left_index, const AABB& bbox, int depth, NodeArray& out)
+{
+	unsigned int index = out.size();
+	out.push_back(LinearBVHNode());
+	out[index].setAABB(bbox);
+
+	int right_index = (int)prims.size();
+	int n = right_index - left_index;
+
+	SplitCandidate objectSplit, spatialSplit;
+	objectSplit.cost = spatialSplit.cost = INF;
+	bool binned = false;
+	if (n > 1 && depth < maxDepth){
+		binned = findObjectSplit(left_index, right_index, bbox, objectSplit);
+
+		// Spatial splits only pay off where the object split children overlap.
+		AABB overlap = objectSplit.leftBox;
+		overlap.clip(objectSplit.rightBox);
+		if (referencesLeft > 0 && (objectSplit.cost == INF ||
+			(!overlap.isEmpty() && overlap.getArea() > sbvhOverlapThreshold * rootArea))){
+			findSpatialSplit(left_index, right_index, bbox, spatialSplit);
+			if (spatialSplit.cost < INF && spatialSplit.leftCount + spatialSplit.rightCount - n > referencesLeft)
+				spatialSplit.cost = INF;
+		}
+	}
+
+	// Without any valid split, large nodes are still split at the median.
+	bool medianSplit = !binned && n > sahMaxLeafSize && depth < maxDepth;
+	auto keepLeaf = [=](float cost) {
+		return !medianSplit && (cost == INF || (n <= sahMaxLeafSize && cost >= (float)n));
+	};
+	bool spatial = spatialSplit.cost < objectSplit.cost;
+	bool leaf = keepLeaf(spatial ? spatialSplit.cost : objectSplit.cost);
+
+	vector<PrimitiveInfo> leftRefs, rightRefs;
+	if (spatial && !leaf){
+		for (int i = left_index; i < right_index; ++i){
+			const PrimitiveInfo& p = prims[i];
+			if (p.bbox.mMax(spatialSplit.axis) <= spatialSplit.position)
+				leftRefs.push_back(p);
+			else if (p.bbox.mMin(spatialSplit.axis) >= spatialSplit.position)
+				rightRefs.push_back(p);
+			else{
+				PrimitiveInfo l = p, r = p;
+				p.obj->splitAABB(spatialSplit.axis, spatialSplit.position, l.bbox, r.bbox);
+				l.bbox.clip(p.bbox);
+				r.bbox.clip(p.bbox);
+				if (l.bbox.isEmpty())
+					rightRefs.push_back(p);
+				else if (r.bbox.isEmpty())
+					leftRefs.push_back(p);
+				else{
+					for (int k = 0; k < 3; ++k){
+						l.centroid(k) = (l.bbox.mMin(k) + l.bbox.mMax(k)) * 0.5f;
+						r.centroid(k) = (r.bbox.mMin(k) + r.bbox.mMax(k)) * 0.5f;
+					}
+					leftRefs.push_back(l);
+					rightRefs.push_back(r);
+				}
+			}
+		}
+		// Clipping may move every reference to one side, use the object split instead.
+		if (leftRefs.empty() || rightRefs.empty()){
+			spatial = false;
+			leaf = keepLeaf(objectSplit.cost);
+			vector<PrimitiveInfo>().swap(leftRefs);
+			vector<PrimitiveInfo>().swap(rightRefs);
+		}
+		else
+			referencesLeft -= (int)(leftRefs.size() + rightRefs.size()) - n;
 	}
 
-	AABB right;
-	for (int i = split_index; i < right_index; ++i){
-		objs[i]->getAABB(aabb);
-		right.include(aabb);
+	if (leaf){
+		if (n > 0xffff)
+			throw std::runtime_error("(BVHAccelerator::build_sbvh) too many primitives in leaf");
+		out[index].primOffset = objs.size();
+		out[index].nPrims = (unsigned short)n;
+		for (int i = left_index; i < right_index; ++i)
+			objs.push_back(prims[i].obj);
+		prims.resize(left_index);
+		return depth;
 	}
 
-	//Create two new nodes, leftNode and rightNode and assign bounding boxes 
-	BVHNode* leftNode = new BVHNode();
-	BVHNode* rightNode = new BVHNode();
+	int axis;
+	if (spatial){
+		axis = spatialSplit.axis;
+		prims.resize(left_index);
+		prims.insert(prims.end(), leftRefs.begin(), leftRefs.end());
+		vector<PrimitiveInfo>().swap(leftRefs);
+	}
+	else{
+		axis = objectSplit.axis;
+		int split_index = medianSplit ? left_index + n / 2 : partitionObjectSplit(left_index, right_index, objectSplit);
+		rightRefs.assign(prims.begin() + split_index, prims.end());
+		prims.resize(split_index);
+	}
+
+	AABB left, right, centroids;
+	computeBounds(left_index, (int)prims.size(), left, centroids);
+	for (size_t i = 0; i < rightRefs.size(); ++i)
+		right.include(rightRefs[i].bbox);
+
+	out[index].axis = (unsigned char)axis;
+	out[index].nPrims = 0;
+
+	int leftDepth = build_sbvh(left_index, left, depth + 1, out);
+	prims.insert(prims.end(), rightRefs.begin(), rightRefs.end());
+	vector<PrimitiveInfo>().swap(rightRefs);
+	out[index].rightChild = out.size();
+	int rightDepth = build_sbvh(left_index, right, depth + 1, out);
+	return std::max(leftDepth, rightDepth);
+}
 
-	leftNode->setAABB(left);
-	rightNode->setAABB(right);
-	nodes.push_back(leftNode);
-	nodes.push_back(rightNode);
-	//Initiate current node as an interior node with leftNode and rightNode as children 
-	node->makeNode(nodes.size() - 2, right_index - left_index);
-	build_recursive(left_index, split_index, leftNode, depth + 1);
-	build_recursive(split_index, right_index, rightNode, depth + 1);
+/**
+ * Sorts the primitives by the Morton codes of their centroids, quantized
+ * within the centroid bounds. Nearby primitives end up next to each other,
+ * and every common code prefix corresponds to a range of primitives.
+ */
+void BVHAccelerator::sortMorton(const AABB& centroidBox)
+{
+	int count = (int)prims.size();
+	vector<unsigned int> codes(count);
+	#pragma omp parallel for if(count >= parallelBuildThreshold)
+	for (int i = 0; i < count; ++i)
+		codes[i] = encodeMorton(prims[i].centroid, centroidBox);
 
+	radixSortMorton(prims, codes);
+	for (int i = 0; i < count; ++i)
+		prims[i].morton = codes[i];
 }
 
+/**
+ * Splits the Morton sorted primitives where the highest bit that differs
+ * within the range changes from 0 to 1. All primitives in the range share
+ * the code bits above it, so the split is found by a binary search and
+ * no primitives are moved. Primitives with identical codes are split in
+ * the middle. Returns the index of the first right primitive and the
+ * axis of the split bit in axis.
+ */
+int BVHAccelerator::splitMorton(int left_index, int right_index, int& axis)
+{
+	int bit = highestDifferingBit(prims[left_index].morton, prims[right_index - 1].morton);
+	if (bit < 0){
+		axis = 0;
+		return left_index + (right_index - left_index) / 2;
+	}
+
+	axis = bit % 3;
+	vector<PrimitiveInfo>::iterator mid = partition_point(prims.begin() + left_index, prims.begin() + right_index,
+		[bit](const PrimitiveInfo& p) { return ((p.morton >> bit) & 1) == 0; });
+	return (int)(mid - prims.begin());
+}
+
+/**
+ * Slab test of the ray against a box stored as six floats. Same as
+ * AABB::intersect(), the bounds are laid out as bmin followed by bmax so
+ * the ray's direction sign picks the entry plane as sign*3 + axis.
+ */
+static inline bool intersectBox(const float* b, const Ray& ray, float& tmin, float& tmax)
+{
+	float t0 = ray.minT;
+	float t1 = ray.maxT;
+	t0 = std::max(t0, (b[ray.sign[0] * 3] - ray.orig.x) * ray.invDir.x);
+	t1 = std::min(t1, (b[3 - ray.sign[0] * 3] - ray.orig.x) * ray.invDir.x);
+	t0 = std::max(t0, (b[ray.sign[1] * 3 + 1] - ray.orig.y) * ray.invDir.y);
+	t1 = std::min(t1, (b[4 - ray.sign[1] * 3] - ray.orig.y) * ray.invDir.y);
+	t0 = std::max(t0, (b[ray.sign[2] * 3 + 2] - ray.orig.z) * ray.invDir.z);
+	t1 = std::min(t1, (b[5 - ray.sign[2] * 3] - ray.orig.z) * ray.invDir.z);
+	tmin = t0;
+	tmax = t1;
+	return t0 <= t1;
+}
+
+static inline bool intersectNode(const LinearBVHNode& node, const Ray& ray, float& tmin, float& tmax)
+{
+	return intersectBox(node.bmin, ray, tmin, tmax);
+}
+
+/**
+ * Returns true if the ray hits any primitive.
+ */
 bool BVHAccelerator::intersect(const Ray& ray)
 {
+	return findOccluder(ray) != 0;
+}
+
+/**
+ * Returns the first primitive found to block the ray. Each node's box is
+ * tested once, by its parent, before the node is pushed on the stack, and
+ * the ray's maxT culls the nodes beyond the end of the ray, e.g. behind the
+ * light of a shadow ray. The child nearer to the ray origin along the split
+ * axis is visited first, since occluders close to the origin are found
+ * sooner that way.
+ */
+Intersectable* BVHAccelerator::findOccluder(const Ray& ray)
+{
+	if (!qnodes.empty())
+		return findOccluderQuantized(ray);
+
+	TraversalStats stats(ray, true);
 	float tmin, tmax;
-	Ray rayCopy(ray);
-	stack<BVHNode*> nodeStack;
-	nodeStack.push(root);
+	if (nodes.empty())
+		return 0;
+	stats.testBoxes(1);
+	if (!intersectNode(nodes[0], ray, tmin, tmax))
+		return 0;
+
+	NodeStack nodeStack;
+	nodeStack.push(0);
 
 	while (!nodeStack.empty()){
-		BVHNode* node = nodeStack.top();
+		unsigned int index = nodeStack.top();
+		const LinearBVHNode& node = nodes[index];
 		nodeStack.pop();
+		stats.visitNode();
 
-		if (node->getAABB().intersect(rayCopy, tmin, tmax)){
-			if (node->isLeaf()){
-				for (int i = node->getIndex(); i < node->getIndex() + node->getNObjs(); ++i){
-					Intersectable* obj = objs[i];
-					if (obj->intersect(rayCopy)){
-						return true;
-					}
-				}
+		if (node.isLeaf()){
+			Intersectable* obj = findLeafOccluder(index, node.primOffset, node.nPrims, node.axis, node.nSpheres, ray, stats);
+			if (obj)
+				return obj;
+		}
+		else{
+			// Push the far child first so that the near one is popped next.
+			unsigned int nearChild = index + 1;
+			unsigned int farChild = node.rightChild;
+			if (ray.sign[node.axis])
+				std::swap(nearChild, farChild);
+			stats.testBoxes(2);
+
+			if (intersectNode(nodes[farChild], ray, tmin, tmax)){
+				nodeStack.push(farChild);
 			}
-			else{
-				BVHNode* left = nodes[node->getIndex()];
-				BVHNode* right = nodes[node->getIndex() + 1];
+			if (intersectNode(nodes[nearChild], ray, tmin, tmax)){
+				nodeStack.push(nearChild);
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Finds the closest hit along the ray. The children of a node are visited
+ * front-to-back, and their entry distance is kept on the stack so that
+ * nodes starting beyond the closest hit found so far are skipped when popped.
+ */
+bool BVHAccelerator::intersect(const Ray& ray, Intersection& is)
+{
+	if (!qnodes.empty())
+		return intersectQuantized(ray, is);
 
-				if (right->getAABB().intersect(rayCopy, tmin, tmax)){
+	TraversalStats stats(ray, false);
+	float tmin, tmax;
+	if (nodes.empty())
+		return false;
+	stats.testBoxes(1);
+	if (!intersectNode(nodes[0], ray, tmin, tmax))
+		return false;
+
+	Ray rayCopy(ray);
+	bool hit = false;
+	PackHit packHit = { 0, 0, 0.0f, 0.0f };
+	OrderedNodeStack nodeStack;
+	StackItem rootItem = { 0, tmin };
+	nodeStack.push(rootItem);
+
+	while (!nodeStack.empty()){
+		StackItem item = nodeStack.top();
+		nodeStack.pop();
+		if (item.t > rayCopy.maxT)
+			continue;
+
+		const LinearBVHNode& node = nodes[item.node];
+		stats.visitNode();
+		if (node.isLeaf()){
+			if (intersectLeaf(item.node, node.primOffset, node.nPrims, node.axis, node.nSpheres, rayCopy, is, packHit, stats))
+				hit = true;
+		}
+		else{
+			StackItem left = { item.node + 1, 0.0f };
+			StackItem right = { node.rightChild, 0.0f };
+			stats.testBoxes(2);
+			bool hitLeft = intersectNode(nodes[left.node], rayCopy, left.t, tmax);
+			bool hitRight = intersectNode(nodes[right.node], rayCopy, right.t, tmax);
+
+			if (hitLeft && hitRight){
+				// Push the farther child first so the nearer one is popped next.
+				if (left.t <= right.t){
 					nodeStack.push(right);
+					nodeStack.push(left);
 				}
-				if (left->getAABB().intersect(rayCopy, tmin, tmax)){
+				else{
 					nodeStack.push(left);
+					nodeStack.push(right);
 				}
 			}
+			else if (hitLeft){
+				nodeStack.push(left);
+			}
+			else if (hitRight){
+				nodeStack.push(right);
+			}
 		}
 	}
-	return false;
+	finishHit(rayCopy, packHit, is);
+	return hit;
 }
 
-bool BVHAccelerator::intersect(const Ray& ray, Intersection& is)
+/**
+ * Any-hit traversal of the compressed nodes, see findOccluder().
+ * The children's boxes are decoded from the parent box on the stack.
+ */
+Intersectable* BVHAccelerator::findOccluderQuantized(const Ray& ray)
 {
-	struct StackItem{
-		BVHNode* node;
-		float t;
-	};
+	TraversalStats stats(ray, true);
+	float tmin, tmax;
+	stats.testBoxes(1);
+	if (!intersectBox(rootBox, ray, tmin, tmax))
+		return 0;
+
+	QuantizedNodeStack nodeStack;
+	QuantizedStackItem rootItem = { 0, tmin, { rootBox[0], rootBox[1], rootBox[2], rootBox[3], rootBox[4], rootBox[5] } };
+	nodeStack.push(rootItem);
+
+	while (!nodeStack.empty()){
+		QuantizedStackItem item = nodeStack.top();
+		const QuantizedBVHNode& node = qnodes[item.node];
+		nodeStack.pop();
+		stats.visitNode();
+
+		if (node.isLeaf()){
+			Intersectable* obj = findLeafOccluder(item.node, node.primOffset, node.nPrims, node.axis, node.nSpheres, ray, stats);
+			if (obj)
+				return obj;
+		}
+		else{
+			QuantizedStackItem nearChild, farChild;
+			nearChild.node = item.node + 1;
+			farChild.node = node.rightChild;
+			if (ray.sign[node.axis])
+				std::swap(nearChild.node, farChild.node);
+			qnodes[nearChild.node].decode(item.box, nearChild.box);
+			qnodes[farChild.node].decode(item.box, farChild.box);
+			stats.testBoxes(2);
+
+			if (intersectBox(farChild.box, ray, farChild.t, tmax)){
+				nodeStack.push(farChild);
+			}
+			if (intersectBox(nearChild.box, ray, nearChild.t, tmax)){
+				nodeStack.push(nearChild);
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Closest-hit traversal of the compressed nodes, see
+ * intersect(const Ray&, Intersection&).
+ */
+bool BVHAccelerator::intersectQuantized(const Ray& ray, Intersection& is)
+{
+	TraversalStats stats(ray, false);
 	float tmin, tmax;
+	stats.testBoxes(1);
+	if (!intersectBox(rootBox, ray, tmin, tmax))
+		return false;
+
 	Ray rayCopy(ray);
 	bool hit = false;
-	stack<BVHNode*> nodeStack;
-	nodeStack.push(root);
+	PackHit packHit = { 0, 0, 0.0f, 0.0f };
+	QuantizedNodeStack nodeStack;
+	QuantizedStackItem rootItem = { 0, tmin, { rootBox[0], rootBox[1], rootBox[2], rootBox[3], rootBox[4], rootBox[5] } };
+	nodeStack.push(rootItem);
 
 	while (!nodeStack.empty()){
-		BVHNode* node = nodeStack.top();
+		QuantizedStackItem item = nodeStack.top();
 		nodeStack.pop();
+		if (item.t > rayCopy.maxT)
+			continue;
 
-		if (node->getAABB().intersect(rayCopy, tmin, tmax)){
-			if (node->isLeaf()){
-				for (int i = node->getIndex(); i < node->getIndex() + node->getNObjs(); ++i){
-					Intersectable* obj = objs[i];
-					if (obj->intersect(rayCopy, is)){
-						rayCopy.maxT = is.mHitTime;
-						hit = true;
-					}
-				}
-			}
-			else{
-				BVHNode* left = nodes[node->getIndex()];
-				BVHNode* right = nodes[node->getIndex() + 1];
+		const QuantizedBVHNode& node = qnodes[item.node];
+		stats.visitNode();
+		if (node.isLeaf()){
+			if (intersectLeaf(item.node, node.primOffset, node.nPrims, node.axis, node.nSpheres, rayCopy, is, packHit, stats))
+				hit = true;
+		}
+		else{
+			QuantizedStackItem left, right;
+			left.node = item.node + 1;
+			right.node = node.rightChild;
+			qnodes[left.node].decode(item.box, left.box);
+			qnodes[right.node].decode(item.box, right.box);
+			stats.testBoxes(2);
+			bool hitLeft = intersectBox(left.box, rayCopy, left.t, tmax);
+			bool hitRight = intersectBox(right.box, rayCopy, right.t, tmax);
 
-				if (right->getAABB().intersect(rayCopy, tmin, tmax)){
+			if (hitLeft && hitRight){
+				// Push the farther child first so the nearer one is popped next.
+				if (left.t <= right.t){
 					nodeStack.push(right);
+					nodeStack.push(left);
 				}
-				if (left->getAABB().intersect(rayCopy, tmin, tmax)){
+				else{
 					nodeStack.push(left);
+					nodeStack.push(right);
 				}
 			}
+			else if (hitLeft){
+				nodeStack.push(left);
+			}
+			else if (hitRight){
+				nodeStack.push(right);
+			}
 		}
 	}
+	finishHit(rayCopy, packHit, is);
 	return hit;
 }
 
-void BVHAccelerator::print_rec(BVHNode& node, int depth)
+/**
+ * Finds the closest hit of each ray in a coherent packet. The packet walks
+ * the tree as one, nearest child first along the split axis. Each node is
+ * first tested against interval bounds of the whole packet, which culls
+ * most missed nodes with a single test. Otherwise the rays are tested one
+ * by one from the first one that hit the parent, and the children are
+ * only visited from the first ray that hits the node. As the rays diverge
+ * this reduces to testing a single ray per node. The leaves test each
+ * remaining ray that hits their box. Packets that are not coherent, and
+ * trees with compressed nodes, are traced one ray at a time.
+ */
+unsigned int BVHAccelerator::intersect(const RayPacket& packet, Intersection* is)
 {
+	if (nodes.empty() || !qnodes.empty() || !packet.isCoherent())
+		return RayAccelerator::intersect(packet, is);
+
+	TraversalStats stats(packet.rays[0], false);
+	stats.setRays(packet.size);
+
+	Ray rays[RayPacket::maxSize];
+	PackHit packHits[RayPacket::maxSize];
+	for (int i = 0; i < packet.size; ++i){
+		rays[i] = packet.rays[i];
+		packHits[i].tri = 0;
+		packHits[i].sphere = 0;
+	}
+	RayPacketBounds bounds(packet);
+	const int* sign = packet.rays[0].sign;
+	unsigned int hits = 0;
+
+	PacketNodeStack nodeStack;
+	PacketStackItem rootItem = { 0, 0 };
+	nodeStack.push(rootItem);
+
+	while (!nodeStack.empty()){
+		PacketStackItem item = nodeStack.top();
+		nodeStack.pop();
+
+		const LinearBVHNode& node = nodes[item.node];
+		stats.testBoxes(1);
+		if (!bounds.mayHit(node.bmin))
+			continue;
+
+		float tmin, tmax;
+		int first = item.first;
+		for (; first < packet.size; ++first){
+			stats.testBoxes(1);
+			if (intersectNode(node, rays[first], tmin, tmax))
+				break;
+		}
+		if (first == packet.size)
+			continue;
+
+		stats.visitNode();
+		if (node.isLeaf()){
+			bool shortened = false;
+			for (int i = first; i < packet.size; ++i){
+				if (i > first){
+					stats.testBoxes(1);
+					if (!intersectNode(node, rays[i], tmin, tmax))
+						continue;
+				}
+				if (intersectLeaf(item.node, node.primOffset, node.nPrims, node.axis, node.nSpheres, rays[i], is[i], packHits[i], stats)){
+					hits |= 1u << i;
+					shortened = true;
+				}
+			}
+			if (shortened){
+				bounds.maxT = rays[0].maxT;
+				for (int i = 1; i < packet.size; ++i)
+					bounds.maxT = std::max(bounds.maxT, rays[i].maxT);
+			}
+		}
+		else{
+			// Push the far child first so that the near one is popped next.
+			PacketStackItem nearChild = { item.node + 1, first };
+			PacketStackItem farChild = { node.rightChild, first };
+			if (sign[node.axis])
+				std::swap(nearChild, farChild);
+			nodeStack.push(farChild);
+			nodeStack.push(nearChild);
+		}
+	}
+
+	for (int i = 0; i < packet.size; ++i){
+		if (hits & (1u << i))
+			finishHit(rays[i], packHits[i], is[i]);
+	}
+	return hits;
+}
+
+/**
+ * Finds a primitive that blocks each ray in a coherent packet, with the
+ * same packet traversal as intersect(const RayPacket&, Intersection*).
+ * Rays are dropped from the packet as soon as they are blocked, and the
+ * traversal ends when all of them are.
+ */
+unsigned int BVHAccelerator::findOccluders(const RayPacket& packet, Intersectable** occluders)
+{
+	if (nodes.empty() || !qnodes.empty() || !packet.isCoherent())
+		return RayAccelerator::findOccluders(packet, occluders);
+
+	TraversalStats stats(packet.rays[0], true);
+	stats.setRays(packet.size);
+
+	for (int i = 0; i < packet.size; ++i)
+		occluders[i] = 0;
+	RayPacketBounds bounds(packet);
+	const int* sign = packet.rays[0].sign;
+	unsigned int active = packet.all();
+
+	PacketNodeStack nodeStack;
+	PacketStackItem rootItem = { 0, 0 };
+	nodeStack.push(rootItem);
+
+	while (!nodeStack.empty()){
+		PacketStackItem item = nodeStack.top();
+		nodeStack.pop();
+
+		const LinearBVHNode& node = nodes[item.node];
+		stats.testBoxes(1);
+		if (!bounds.mayHit(node.bmin))
+			continue;
+
+		float tmin, tmax;
+		int first = item.first;
+		for (; first < packet.size; ++first){
+			if (!(active & (1u << first)))
+				continue;
+			stats.testBoxes(1);
+			if (intersectNode(node, packet.rays[first], tmin, tmax))
+				break;
+		}
+		if (first == packet.size)
+			continue;
+
+		stats.visitNode();
+		if (node.isLeaf()){
+			for (int i = first; i < packet.size; ++i){
+				if (!(active & (1u << i)))
+					continue;
+				if (i > first){
+					stats.testBoxes(1);
+					if (!intersectNode(node, packet.rays[i], tmin, tmax))
+						continue;
+				}
+				occluders[i] = findLeafOccluder(item.node, node.primOffset, node.nPrims, node.axis, node.nSpheres, packet.rays[i], stats);
+				if (occluders[i])
+					active &= ~(1u << i);
+			}
+			if (!active)
+				break;
+		}
+		else{
+			PacketStackItem nearChild = { item.node + 1, first };
+			PacketStackItem farChild = { node.rightChild, first };
+			if (sign[node.axis])
+				std::swap(nearChild, farChild);
+			nodeStack.push(farChild);
+			nodeStack.push(nearChild);
+		}
+	}
+	return packet.all() & ~active;
+}
+
+/**
+ * Fills in the intersection of the closest hit if it was found in the typed
+ * arrays. The ray's maxT is the distance to that hit.
+ */
+inline void BVHAccelerator::finishHit(const Ray& ray, const PackHit& packHit, Intersection& is) const
+{
+	if (packHit.tri)
+		packHit.tri->setIntersection(ray, ray.maxT, packHit.v, packHit.w, is);
+	else if (packHit.sphere)
+		packHit.sphere->setIntersection(ray, ray.maxT, is);
+}
+
+/**
+ * Returns the first primitive of leaf number index that blocks the ray.
+ * The first nTris primitives are tested through the leaf's packs and the
+ * following nSpheres through its world-space spheres.
+ */
+inline Intersectable* BVHAccelerator::findLeafOccluder(unsigned int index, unsigned int primOffset, unsigned int nPrims,
+	unsigned int nTris, unsigned int nSpheres, const Ray& ray, TraversalStats& stats) const
+{
+	unsigned int first = primOffset;
+	if (!leafOffsets.empty()){
+		const TrianglePack* pack = &packs[leafOffsets[index].pack];
+		for (unsigned int j = 0; j < nTris; j += 4, ++pack){
+			__m128 t, v, w;
+			stats.testPrimitives(std::min(nTris - j, 4u));
+			int mask = pack->intersect(ray, ray.maxT, t, v, w);
+			if (mask){
+				for (int lane = 0; lane < 4; ++lane){
+					if (mask & (1 << lane))
+						return objs[primOffset + j + lane];
+				}
+			}
+		}
+		const WorldSphere* sphere = &spheres[leafOffsets[index].sphere];
+		for (unsigned int j = 0; j < nSpheres; ++j, ++sphere){
+			float t;
+			stats.testPrimitive();
+			if (sphere->intersect(ray, ray.maxT, t))
+				return objs[primOffset + nTris + j];
+		}
+		first += nTris + nSpheres;
+	}
+	for (unsigned int i = first; i < primOffset + nPrims; ++i){
+		Intersectable* obj = objs[i];
+		stats.testPrimitive();
+		if (obj->intersect(ray))
+			return obj;
+	}
+	return 0;
+}
+
+/**
+ * Intersects the ray with the primitives of leaf number index, shortening
+ * ray.maxT at each hit. Hits found in the typed arrays are only recorded in
+ * packHit, the intersection is filled in by finishHit() once the closest
+ * hit is known. Hits on other primitives fill in is and clear packHit.
+ */
+inline bool BVHAccelerator::intersectLeaf(unsigned int index, unsigned int primOffset, unsigned int nPrims,
+	unsigned int nTris, unsigned int nSpheres, Ray& ray, Intersection& is, PackHit& packHit, TraversalStats& stats) const
+{
+	bool hit = false;
+	unsigned int first = primOffset;
+	if (!leafOffsets.empty()){
+		const TrianglePack* pack = &packs[leafOffsets[index].pack];
+		for (unsigned int j = 0; j < nTris; j += 4, ++pack){
+			__m128 t, v, w;
+			stats.testPrimitives(std::min(nTris - j, 4u));
+			int mask = pack->intersect(ray, ray.maxT, t, v, w);
+			for (int lane = 0; lane < 4; ++lane){
+				if ((mask & (1 << lane)) && ((float*)&t)[lane] < ray.maxT){
+					ray.maxT = ((float*)&t)[lane];
+					packHit.tri = pack->tri[lane];
+					packHit.sphere = 0;
+					packHit.v = ((float*)&v)[lane];
+					packHit.w = ((float*)&w)[lane];
+					hit = true;
+				}
+			}
+		}
+		const WorldSphere* sphere = &spheres[leafOffsets[index].sphere];
+		for (unsigned int j = 0; j < nSpheres; ++j, ++sphere){
+			float t;
+			stats.testPrimitive();
+			if (sphere->intersect(ray, ray.maxT, t)){
+				ray.maxT = t;
+				packHit.tri = 0;
+				packHit.sphere = sphere->sphere;
+				hit = true;
+			}
+		}
+		first += nTris + nSpheres;
+	}
+	for (unsigned int i = first; i < primOffset + nPrims; ++i){
+		Intersectable* obj = objs[i];
+		stats.testPrimitive();
+		if (obj->intersect(ray, is)){
+			ray.maxT = is.mHitTime;
+			packHit.tri = 0;
+			packHit.sphere = 0;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+void BVHAccelerator::print_rec(unsigned int index, int depth)
+{
+	const LinearBVHNode& node = nodes[index];
 	cout << setw(depth * 2) << ' ';
 	if (node.isLeaf())
-		cout << "Leaf<Primitives: " << node.getNObjs() << ", First primitive: " << node.getIndex() << ">" << endl;
+		cout << "Leaf<Primitives: " << node.nPrims << ", First primitive: " << node.primOffset << ">" << endl;
 	else {
-		std::cout << "Node<Primitives: " << node.getNObjs() << ">" << endl;
-		BVHNode* left = nodes[node.getIndex()];
-		BVHNode* right = nodes[node.getIndex() + 1];
-		print_rec(*left, depth + 1);
-		print_rec(*right, depth + 1);
+		std::cout << "Node<Axis: " << (int)node.axis << ">" << endl;
+		print_rec(index + 1, depth + 1);
+		print_rec(node.rightChild, depth + 1);
 	}
 }
-void BVHAccelerator::print()
+/**
+ * Computes the statistics of the current tree. The SAH cost is the sum of
+ * the traversal cost of the interior nodes and the primitive count of the
+ * leaves, each weighted by its probability of being hit by a ray that hits
+ * the root, i.e. the ratio of the surface areas.
+ */
+BVHAccelerator::Statistics BVHAccelerator::getStatistics() const
 {
-	cout << "Printing nodes..." << endl;
+	Statistics stats;
+	stats.nodes = (int)nodes.size();
+	stats.leaves = 0;
+	stats.depth = 0;
+	stats.sahCost = 0.0f;
+	stats.references = 0;
+	stats.memory = nodes.size() * sizeof(LinearBVHNode) + qnodes.size() * sizeof(QuantizedBVHNode) + objs.size() * sizeof(Intersectable*);
+	stats.memory += packs.size() * sizeof(TrianglePack) + spheres.size() * sizeof(WorldSphere) + leafOffsets.size() * sizeof(LeafOffsets);
+	if (nodes.empty()){
+		stats.primitivesPerLeaf = 0.0f;
+		return stats;
+	}
+
+	float invRootArea = 1.0f / nodes[0].getAABB().getArea();
+	NodeStack nodeStack;
+	TraversalStack<int, maxDepth + 1> depthStack;
+	nodeStack.push(0);
+	depthStack.push(0);
+	while (!nodeStack.empty()){
+		unsigned int index = nodeStack.top();
+		const LinearBVHNode& node = nodes[index];
+		int depth = depthStack.top();
+		nodeStack.pop();
+		depthStack.pop();
+
+		float p = node.getAABB().getArea() * invRootArea;
+		if (node.isLeaf()){
+			stats.leaves++;
+			stats.references += node.nPrims;
+			stats.sahCost += p * node.nPrims;
+			if ((int)stats.leafDepths.size() <= depth)
+				stats.leafDepths.resize(depth + 1, 0);
+			stats.leafDepths[depth]++;
+			stats.depth = std::max(stats.depth, depth);
+		}
+		else{
+			stats.sahCost += p * sahTraversalCost;
+			nodeStack.push(node.rightChild);
+			depthStack.push(depth + 1);
+			nodeStack.push(index + 1);
+			depthStack.push(depth + 1);
+		}
+	}
+	stats.primitivesPerLeaf = (float)stats.references / stats.leaves;
+	return stats;
+}
+
+/**
+ * Prints the statistics of the tree, and the complete tree if dumpTree is set.
+ */
+void BVHAccelerator::print(bool dumpTree)
+{
+	if (nodes.empty())
+		return;
+	AABB worldBox = nodes[0].getAABB();
+	Statistics stats = getStatistics();
+	cout << "BVH statistics:" << endl;
 	cout << "World Bounds: " << endl;
-	cout << "Min: " << root->getAABB().mMin;
-	cout << "Max: " << root->getAABB().mMax << endl;
-	print_rec(*root, 1);
+	cout << "Min: " << worldBox.mMin;
+	cout << "Max: " << worldBox.mMax << endl;
+	cout << "Nodes: " << stats.nodes << " (" << stats.nodes - stats.leaves << " interior, " << stats.leaves << " leaves)" << endl;
+	cout << "Primitive references: " << stats.references << ", per leaf: " << stats.primitivesPerLeaf << endl;
+	cout << "SAH cost: " << stats.sahCost << endl;
+	cout << "Memory: " << stats.memory / 1024 << " kB (" << sizeof(LinearBVHNode) << " bytes per node";
+	if (!qnodes.empty())
+		cout << ", " << sizeof(QuantizedBVHNode) << " bytes per compressed node";
+	cout << ")" << endl;
+	cout << "Leaf depths (max " << stats.depth << "):" << endl;
+	for (size_t d = 0; d < stats.leafDepths.size(); ++d){
+		if (stats.leafDepths[d] > 0)
+			cout << setw(6) << d << ": " << stats.leafDepths[d] << endl;
+	}
+	if (dumpTree)
+		print_rec(0, 1);
 }
@@ -11,21 +11,189 @@
 
 #include "rayaccelerator.h"
 #include "bvhnode.h"
+#include "alignedallocator.h"
+#include "trianglepack.h"
+#include "sphere.h"
+#include <string>
+
+class TraversalStats;
 
 class BVHAccelerator : public RayAccelerator
 {
+public:
+	/// Strategy used to partition the primitives of an interior node.
+	enum SplitMethod {
+		SPLIT_MIDPOINT,		///< Split at the spatial midpoint of the largest axis.
+		SPLIT_SAH,			///< Binned surface area heuristic.
+		SPLIT_LBVH,			///< Linear BVH, split at the highest differing bit of sorted Morton codes.
+		SPLIT_HLBVH,		///< Linear BVH treelets, with the levels above them built by SAH.
+		SPLIT_SBVH			///< SAH with spatial splits, primitives may be referenced by several leaves.
+	};
+
+	typedef std::vector<LinearBVHNode, AlignedAllocator<LinearBVHNode, 64> > NodeArray;
+	typedef std::vector<QuantizedBVHNode, AlignedAllocator<QuantizedBVHNode, 64> > QuantizedNodeArray;
+
+	/// Hard limit on the tree depth, the traversal stacks are sized from it.
+	static const int maxDepth = 64;
+
+	/// Quality and memory figures of the current tree, see getStatistics().
+	struct Statistics {
+		int nodes;
+		int leaves;
+		int depth;						///< Depth of the deepest leaf.
+		std::vector<int> leafDepths;	///< Number of leaves at each depth.
+		float sahCost;					///< Expected cost of a ray hitting the root, in primitive tests.
+		float primitivesPerLeaf;
+		size_t references;				///< Number of primitive references in the leaves.
+		size_t memory;					///< Bytes used by the nodes, the primitive references and the packed primitives.
+	};
+
 private:
+	/// Per-primitive data cached once before the build starts.
+	struct PrimitiveInfo {
+		Intersectable* obj;
+		AABB bbox;
+		Point3D centroid;
+		unsigned int morton;	///< Morton code of the centroid, only used by the linear builders.
+	};
+
+	/// Best split of a node found by one of the binned SAH evaluations.
+	struct SplitCandidate {
+		float cost;			///< SAH cost relative to the node's area, INF if there is no valid split.
+		int axis;
+		int bin;			///< Object split: last centroid bin on the left side.
+		float binMin;		///< Object split: start of the binned centroid range.
+		float binScale;		///< Object split: bins per unit length.
+		float position;		///< Spatial split: position of the split plane.
+		int leftCount;		///< Number of references on each side,
+		int rightCount;		///< straddling references count on both.
+		AABB leftBox;
+		AABB rightBox;
+	};
+
 	std::vector<Intersectable*> objs;
-	BVHNode* root;
-	std::vector<BVHNode*> nodes;
+	std::vector<PrimitiveInfo> prims;
+	NodeArray nodes;	///< Depth-first node array, root first.
+	SplitMethod splitMethod;
+	int treeDepth;		///< Depth of the deepest leaf in the current tree.
+	float builtCost;		///< SAH cost of the tree right after the last build.
+	float refitThreshold;	///< Cost increase, relative to builtCost, that triggers a rebuild on refit.
+	float referenceBudget;	///< Extra references the SBVH builder may create, relative to the primitive count.
+	int referencesLeft;		///< Remaining reference budget of the current SBVH build.
+	float rootArea;			///< Surface area of the root box of the current build.
+	std::string cacheFile;	///< Path of the on-disk tree cache, empty if caching is disabled.
+	bool useQuantizedNodes;	///< Traverse the compressed node array instead of the full-precision one.
+	QuantizedNodeArray qnodes;	///< Compressed copy of nodes, empty unless useQuantizedNodes is set.
+	float rootBox[6];		///< Full-precision root box the compressed nodes are decoded from.
+	bool usePackedPrimitives;	///< Intersect triangles and spheres from typed arrays instead of through Intersectable.
+	std::vector<TrianglePack, AlignedAllocator<TrianglePack, 64> > packs;
+	std::vector<WorldSphere> spheres;
+
+	/// Index of the first pack and the first sphere of a leaf.
+	struct LeafOffsets {
+		unsigned int pack;
+		unsigned int sphere;
+	};
+	std::vector<LeafOffsets> leafOffsets;	///< By node. Empty unless packed primitives are used.
+
+	/// Closest hit found in the typed arrays, the intersection is filled in once the traversal is done.
+	struct PackHit {
+		const Triangle* tri;		///< Triangle hit, or 0.
+		const Sphere* sphere;		///< Sphere hit, or 0.
+		float v;
+		float w;
+	};
+
+	void computeBounds(int left_index, int right_index, AABB& bbox, AABB& centroidBox) const;
+	static void appendSubtree(NodeArray& out, const NodeArray& subtree);
+	int splitMidpoint(int left_index, int right_index, const AABB& bbox, int& axis);
+	int splitSAH(int left_index, int right_index, const AABB& bbox, int& axis);
+	bool findObjectSplit(int left_index, int right_index, const AABB& bbox, SplitCandidate& split) const;
+	int partitionObjectSplit(int left_index, int right_index, const SplitCandidate& split);
+	void findSpatialSplit(int left_index, int right_index, const AABB& bbox, SplitCandidate& split) const;
+	int build_sbvh(int left_index, const AABB& bbox, int depth, NodeArray& out);
+	int splitMorton(int left_index, int right_index, int& axis);
+	void sortMorton(const AABB& centroidBox);
+	unsigned long long cacheKey() const;
+	bool loadCache(unsigned long long key, const std::vector<Intersectable*>& objects);
+	void saveCache(unsigned long long key, const std::vector<Intersectable*>& objects) const;
+	void buildQuantizedNodes();
+	void buildPackedPrimitives();
+	void finishHit(const Ray& ray, const PackHit& packHit, Intersection& is) const;
+	Intersectable* findLeafOccluder(unsigned int index, unsigned int primOffset, unsigned int nPrims, unsigned int nTris,
+		unsigned int nSpheres, const Ray& ray, TraversalStats& stats) const;
+	bool intersectLeaf(unsigned int index, unsigned int primOffset, unsigned int nPrims, unsigned int nTris,
+		unsigned int nSpheres, Ray& ray, Intersection& is, PackHit& packHit, TraversalStats& stats) const;
+	Intersectable* findOccluderQuantized(const Ray& ray);
+	bool intersectQuantized(const Ray& ray, Intersection& is);
 
 public:
+	BVHAccelerator(SplitMethod method = SPLIT_SAH);
+
 	virtual void build(const std::vector<Intersectable*>& objects);
-	void build_recursive(int left_index, int right_index, BVHNode* node, int depth);
+	int build_recursive(int left_index, int right_index, const AABB& bbox, int depth, NodeArray& out);
+
+	/**
+	 * Sets how many additional primitive references the SBVH builder may
+	 * create by spatial splits, as a fraction of the number of primitives.
+	 * The default 0.3 allows 30% more references than primitives.
+	 */
+	void setReferenceBudget(float budget) { referenceBudget = budget; }
+
+	/**
+	 * Enables the on-disk tree cache. build() then looks for a tree built
+	 * from primitives with the same bounds in the file, and maps it instead
+	 * of building, otherwise the new tree is written to the file. An empty
+	 * name disables the cache. SPLIT_SBVH trees are always built.
+	 */
+	void setCacheFile(const std::string& filename) { cacheFile = filename; }
+
+	/**
+	 * Selects the compressed node format for traversal. Each node then takes
+	 * 16 bytes instead of 32, with its box stored as 8-bit offsets within
+	 * its parent's box. The boxes are rounded outward, so the result is the
+	 * same, at the cost of decoding the boxes and some extra box hits.
+	 * Takes effect at the next build().
+	 */
+	void setQuantizedNodes(bool enable) { useQuantizedNodes = enable; }
+
+	/**
+	 * Selects whether the leaves keep their triangles and spheres in typed
+	 * arrays, instead of testing every primitive through Intersectable.
+	 * The triangles are then intersected four at a time from precomputed
+	 * TrianglePacks, and spheres under a similarity transform are tested
+	 * in world space from their WorldSphere. Other primitives still go
+	 * through the virtual calls. Enabled by default. Takes effect at the
+	 * next build().
+	 */
+	void setPackedPrimitives(bool enable) { usePackedPrimitives = enable; }
+
+	virtual void refit(const std::vector<Intersectable*>& objects);
 	virtual bool intersect(const Ray& ray);
+	virtual Intersectable* findOccluder(const Ray& ray);
 	virtual bool intersect(const Ray& ray, Intersection& is);
-	void print_rec(BVHNode& node, int depth);
-	void print();
+	virtual unsigned int intersect(const RayPacket& packet, Intersection* is);
+	virtual unsigned int findOccluders(const RayPacket& packet, Intersectable** occluders);
+
+	/**
+	 * Sets how much the SAH cost of a refitted tree may grow, relative to the
+	 * cost right after the last build, before refit() rebuilds instead.
+	 * The default 1.5 rebuilds when the tree has become 50% more expensive.
+	 */
+	void setRefitThreshold(float threshold) { refitThreshold = threshold; }
+
+	void print_rec(unsigned int index, int depth);
+	void print(bool dumpTree = false);
+	Statistics getStatistics() const;
+
+	/// Returns the node array in depth-first order, the root is the first node.
+	const NodeArray& getNodes() const { return nodes; }
+
+	/// Returns the primitives in the order referenced by the leaves.
+	const std::vector<Intersectable*>& getObjects() const { return objs; }
+
+	/// Returns the depth of the deepest leaf, the root has depth 0.
+	int getDepth() const { return treeDepth; }
 };
 
-#endif
\ No newline at end of file
+#endif
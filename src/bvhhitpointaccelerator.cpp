@@ -5,12 +5,15 @@
 */
 
 #include "bvhhitpointaccelerator.h"
+#include "traversalstack.h"
+#include "morton.h"
 #include <algorithm> 
 #include <iomanip>
-#include <stack>
 
 using namespace std;
 
+typedef TraversalStack<BVHNode*, BVHHitpointAccelerator::maxDepth + 1> NodeStack;
+
 void getAABB(Hitpoint* hp, AABB& bb){
 	bb = AABB();
 
@@ -23,92 +26,67 @@ void getAABB(Hitpoint* hp, AABB& bb){
 	}
 }
 
-class ComparePrimitives {
-public:
-	bool operator() (Hitpoint *a, Hitpoint *b) {
-		AABB box;
-		getAABB(a, box);
-		float ca = (box.mMax(sort_dim) + box.mMin(sort_dim)) * 0.5f;
-		getAABB(b, box);
-		float cb = (box.mMax(sort_dim) + box.mMin(sort_dim)) * 0.5f;
-		return ca < cb;
-	}
-
-	int sort_dim;
-};
-
 bool intersectAABB(const Point3D& point, const AABB& bb){
 	return point.x >= bb.mMin.x && point.x <= bb.mMax.x &&
 		point.y >= bb.mMin.y && point.y <= bb.mMax.y &&
 		point.z >= bb.mMin.z && point.z <= bb.mMax.z;
 }
 
+/**
+ * Builds the tree as a linear BVH. The hitpoints are sorted by the Morton
+ * codes of their positions, which replaces the per-level sorting of the
+ * previous builder, and each node is split where the highest differing
+ * code bit of its range changes.
+ */
 void BVHHitpointAccelerator::build(const vector<Hitpoint*>& objects)
 {
-	AABB worldBox;
-	for (Hitpoint* o : objects){
+	for (BVHNode* node : nodes)
+		delete node;
+	nodes.clear();
+	objs = objects;
+
+	AABB worldBox, centroidBox;
+	for (Hitpoint* o : objs){
 		AABB temp;
 		getAABB(o, temp);
 		worldBox.include(temp);
-		objs.push_back(o);
+		centroidBox.include(o->is.mPosition);
 	}
+
+	mortonCodes.resize(objs.size());
+	for (size_t i = 0; i < objs.size(); ++i)
+		mortonCodes[i] = encodeMorton(objs[i]->is.mPosition, centroidBox);
+	radixSortMorton(objs, mortonCodes);
+
 	root = new BVHNode();
 	root->setAABB(worldBox);
 	nodes.push_back(root);
+	treeDepth = 0;
 	build_recursive(0, objs.size(), root, 0);
+	vector<unsigned int>().swap(mortonCodes);
+	if (treeDepth + 1 > NodeStack::capacity())
+		throw std::runtime_error("(BVHHitpointAccelerator::build) tree too deep for traversal stack");
 	//print();
 }
 void BVHHitpointAccelerator::build_recursive(int left_index, int right_index, BVHNode* node, int depth){
-	if ((right_index - left_index) <= 3 || depth == 20){// || (other termination criteria)){
+	treeDepth = std::max(treeDepth, depth);
+	if ((right_index - left_index) <= 3 || depth == maxDepth){// || (other termination criteria)){
 		node->makeLeaf(left_index, right_index - left_index );
 		return;
 	}
-	ComparePrimitives cmp;
-	int largestAxis = node->getAABB().getLargestAxis();
-	cmp.sort_dim = largestAxis;
-	sort(objs.begin() + left_index, objs.begin() + right_index, cmp);
-	float split;
-	float currentMid;
-	
-	//node->getAABB().mMax(largestAxis);
-
-	if (largestAxis == 0){
-		split = (node->getAABB().mMax.x + node->getAABB().mMin.x) / 2.0f;
-		currentMid = node->getAABB().mMin.x;
-	}
-	else if (largestAxis == 1){
-		split = (node->getAABB().mMax.y + node->getAABB().mMin.y) / 2.0f;
-		currentMid = node->getAABB().mMin.y;
-	}else{
-		split = (node->getAABB().mMax.z + node->getAABB().mMin.z) / 2.0f;
-		currentMid = node->getAABB().mMin.z;
-	}
 
-	int split_index = left_index;
-	AABB aabb;
-	while (currentMid < split && split_index < right_index){
-		getAABB(objs[split_index], aabb);
-		if (largestAxis == 0){
-			currentMid = (aabb.mMax.x + aabb.mMin.x) / 2.0f;
-		}
-		else if (largestAxis == 1){
-			currentMid = (aabb.mMax.y + aabb.mMin.y) / 2.0f;
-		}
-		else{
-			currentMid = (aabb.mMax.z + aabb.mMin.z) / 2.0f;
-		}
-		++split_index;
-	}
-	//--split_index;
-
-	if (split_index == left_index)
-		++split_index;
-	if (split_index == right_index)
-		--split_index;
-
-	//find split_index
+	// All codes in the range share the bits above the highest differing
+	// bit, so the first code with that bit set starts the right side.
+	int split_index;
+	int bit = highestDifferingBit(mortonCodes[left_index], mortonCodes[right_index - 1]);
+	if (bit < 0)
+		split_index = left_index + (right_index - left_index) / 2;
+	else
+		split_index = (int)(partition_point(mortonCodes.begin() + left_index, mortonCodes.begin() + right_index,
+			[bit](unsigned int code) { return ((code >> bit) & 1) == 0; }) - mortonCodes.begin());
 
 	//calculate bounding boxes for left and right sides
+	AABB aabb;
 	AABB left;
 	for (int i = left_index; i < split_index; ++i){
 		getAABB(objs[i], aabb);
@@ -138,7 +116,7 @@ void BVHHitpointAccelerator::build_recursive(int left_index, int right_index, BV
 void BVHHitpointAccelerator::intersect(const Intersection& is, Color addFlux)
 {
 	float tmin, tmax;
-	stack<BVHNode*> nodeStack;
+	NodeStack nodeStack;
 	nodeStack.push(root);
 
 	while (!nodeStack.empty()){
@@ -28,8 +28,14 @@ class BVHHitpointAccelerator
 private:
 	BVHNode* root;
 	std::vector<BVHNode*> nodes;
+	int treeDepth = 0;		///< Depth of the deepest leaf in the current tree.
+	std::vector<unsigned int> mortonCodes;	///< Sorted Morton codes of objs, only kept during the build.
 
 public:
+	/// Hard limit on the tree depth, the traversal stack is sized from it.
+	/// Deep enough for one level per Morton code bit plus a few median splits.
+	static const int maxDepth = 40;
+
 	std::vector<Hitpoint*> objs;
 
 	virtual void build(const std::vector<Hitpoint*>& objects);
@@ -29,4 +29,111 @@ public:
 	unsigned int getNObjs() { return n_objs; }
 	AABB &getAABB() { return bbox; };
 };
-#endif
\ No newline at end of file
+
+/**
+ * Compact 32 byte BVH node. The nodes are stored contiguously in depth-first
+ * order, so the left child of an interior node is always the next node in
+ * the array and only the index of the right child has to be stored. The
+ * bounds are kept as plain floats to avoid the vtable pointer of AABB.
+ */
+struct LinearBVHNode {
+	float bmin[3];					///< Minimum corner of the node's box.
+	float bmax[3];					///< Maximum corner of the node's box.
+	union {
+		unsigned int primOffset;	///< Leaf: index of the first primitive.
+		unsigned int rightChild;	///< Interior: index of the right child.
+	};
+	unsigned short nPrims;			///< Number of primitives, 0 for interior nodes.
+	unsigned char axis;				///< Split axis of interior nodes, number of packed triangles in leaves.
+	unsigned char nSpheres;			///< Leaf: number of spheres stored in world space, following the triangles.
+
+	void setAABB(const AABB& b)
+	{
+		for (int i = 0; i < 3; ++i) {
+			bmin[i] = b.mMin(i);
+			bmax[i] = b.mMax(i);
+		}
+	}
+	AABB getAABB() const { return AABB(Point3D(bmin[0], bmin[1], bmin[2]), Point3D(bmax[0], bmax[1], bmax[2])); }
+	bool isLeaf() const { return nPrims > 0; }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode must be 32 bytes");
+
+/// Number of steps of the grid the compressed node boxes are snapped to.
+static const int bvhQuantizationSteps = 255;
+
+/**
+ * Returns the coordinate of grid position q between lo and hi. The end
+ * positions 0 and 255 give lo and hi exactly, so a child stored at the
+ * ends of the grid never grows outside its parent.
+ */
+inline float dequantize(float lo, float hi, unsigned char q)
+{
+	float t = q * (1.0f / bvhQuantizationSteps);
+	return lo * (1.0f - t) + hi * t;
+}
+
+/**
+ * Compressed 16 byte BVH node, half the size of LinearBVHNode, so that
+ * four nodes share a cache line. The nodes have the same depth-first order
+ * as the LinearBVHNode array they are made from. The box is stored as
+ * 8-bit positions on a grid spanning the parent's decoded box, rounded
+ * outward, so it can only be decoded during a top-down traversal that
+ * carries the parent box along. The root box is kept in full precision by
+ * the accelerator.
+ */
+struct QuantizedBVHNode {
+	unsigned char qmin[3];			///< Minimum corner, in grid steps of the parent box.
+	unsigned char qmax[3];			///< Maximum corner, in grid steps of the parent box.
+	unsigned short nPrims;			///< Number of primitives, 0 for interior nodes.
+	union {
+		unsigned int primOffset;	///< Leaf: index of the first primitive.
+		unsigned int rightChild;	///< Interior: index of the right child.
+	};
+	unsigned char axis;				///< Same as LinearBVHNode::axis.
+	unsigned char nSpheres;			///< Same as LinearBVHNode::nSpheres.
+	unsigned char pad[2];			///< Padding up to 16 bytes.
+
+	/**
+	 * Stores box, which must lie inside the decoded parent box. The grid
+	 * positions are rounded outward and then checked against the decoding
+	 * itself, so the decoded box always contains box.
+	 */
+	void encode(const float parent[6], const float box[6])
+	{
+		for (int i = 0; i < 3; ++i) {
+			float lo = parent[i];
+			float hi = parent[i + 3];
+			float extent = hi - lo;
+			int qlo = 0;
+			int qhi = bvhQuantizationSteps;
+			if (extent > 0.0f) {
+				qlo = (int)((box[i] - lo) / extent * bvhQuantizationSteps);
+				qhi = (int)((box[i + 3] - lo) / extent * bvhQuantizationSteps) + 1;
+				qlo = qlo < 0 ? 0 : (qlo > bvhQuantizationSteps ? bvhQuantizationSteps : qlo);
+				qhi = qhi < 0 ? 0 : (qhi > bvhQuantizationSteps ? bvhQuantizationSteps : qhi);
+			}
+			while (qlo > 0 && dequantize(lo, hi, (unsigned char)qlo) > box[i])
+				--qlo;
+			while (qhi < bvhQuantizationSteps && dequantize(lo, hi, (unsigned char)qhi) < box[i + 3])
+				++qhi;
+			qmin[i] = (unsigned char)qlo;
+			qmax[i] = (unsigned char)qhi;
+		}
+	}
+
+	/// Decodes the box relative to the decoded parent box, laid out as min followed by max.
+	void decode(const float parent[6], float box[6]) const
+	{
+		for (int i = 0; i < 3; ++i) {
+			box[i] = dequantize(parent[i], parent[i + 3], qmin[i]);
+			box[i + 3] = dequantize(parent[i], parent[i + 3], qmax[i]);
+		}
+	}
+
+	bool isLeaf() const { return nPrims > 0; }
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 16, "QuantizedBVHNode must be 16 bytes");
+#endif
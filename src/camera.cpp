@@ -77,7 +77,9 @@ Ray Camera::getRay(float x, float y) const
 	Ray::Differential dd((d.dot(d) * right - d.dot(right) * d) * r, (d.dot(d) * up - d.dot(up) * d) * r);
 
 	d /= dLength;
-	return Ray(mOrigin, d, dp, dd, mNearPlane, mFarPlane);
+	Ray ray(mOrigin, d, dp, dd, mNearPlane, mFarPlane);
+	ray.primary = true;
+	return ray;
 }
 
 /**
@@ -11,6 +11,7 @@
 #include "diffuse.h"
 #include "sphere.h"
 #include "mesh.h"
+#include "meshinstance.h"
 #include "phong.h"
 #include "emissivematerial.h"
 
@@ -22,29 +23,32 @@ void buildCornellScene(Scene* scene)
 	Diffuse* reflect = new Diffuse(Color(0.7f, 0.7f, 0.7f), 0.5f, 0.0f, 1.0f);
 	Diffuse* refract = new Diffuse(Color(0.7f, 0.7f, 0.7f), 0.0f, 0.5f, 1.5f);
 
-	Mesh* ground = new Mesh("data/plane.obj", white);
+	// The walls share one plane mesh.
+	Mesh* plane = new Mesh("data/plane.obj");
+
+	MeshInstance* ground = new MeshInstance(plane, white);
 	ground->setScale(150.0f);
 	scene->add(ground);
 	
-	Mesh* side1 = new Mesh("data/plane.obj", red);
+	MeshInstance* side1 = new MeshInstance(plane, red);
 	side1->setScale(150.0f);
 	side1->setRotation(180.0f, 0.0f, 90.0f);
 	side1->setTranslation(-60, 60, 0.0f);
 	scene->add(side1);
 	
-	Mesh* side2 = new Mesh("data/plane.obj", blue);
+	MeshInstance* side2 = new MeshInstance(plane, blue);
 	side2->setScale(150.0f);
 	side2->setRotation(0.0f, 0.0f, 90.0f);
 	side2->setTranslation(60, 60, 0.0f);
 	scene->add(side2);
 
-	Mesh* side3 = new Mesh("data/plane.obj", white);
+	MeshInstance* side3 = new MeshInstance(plane, white);
 	side3->setScale(150.0f);
 	side3->setRotation(90.0f, 0.0f, 0.0f);
 	side3->setTranslation(0.0f, 60, -60);
 	scene->add(side3);
 
-	Mesh* roof = new Mesh("data/plane.obj", white);
+	MeshInstance* roof = new MeshInstance(plane, white);
 	roof->setScale(150.0f);
 	roof->setRotation(180.0f, 0.0f, 0.0f);
 	roof->setTranslation(0.0f, 120, 0.0f);
@@ -36,8 +36,12 @@ static const float epsilon = 1e-6f;
 static Diffuse DEFAULT_MATERIAL = Diffuse(Color(0.7f,0.7f,0.7f));
 
 
-/// Returns a uniform random number in the range [0,1).
-static float uniform() { return (float)std::rand()/(1.f+RAND_MAX); }
+/// Thread-local storage specifier, only valid for plain data types.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
 
 /// Helper function for converting an int to a string.
 static std::string int2str(int i)
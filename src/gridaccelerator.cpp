@@ -0,0 +1,260 @@
+/*
+*  gridaccelerator.cpp
+*  prTracer
+*
+*/
+
+#include "gridaccelerator.h"
+#include "raystats.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+/// Largest number of cells along one axis of a grid.
+static const int maxResolution = 256;
+/// Smallest extent of a grid along an axis, relative to its largest extent.
+static const float minRelativeExtent = 1e-4f;
+
+GridAccelerator::GridAccelerator(bool nested) : density(2.0f), nested(nested), nestedThreshold(16)
+{
+}
+
+void GridAccelerator::build(const vector<Intersectable*>& objects)
+{
+	grids.clear();
+	if (objects.empty())
+		return;
+
+	vector<AABB> boxes(objects.size());
+	AABB bounds;
+	for (size_t i = 0; i < objects.size(); ++i){
+		objects[i]->getAABB(boxes[i]);
+		bounds.include(boxes[i]);
+	}
+	grids.push_back(Grid());
+	buildGrid(grids[0], objects, boxes, bounds);
+	if (!nested)
+		return;
+
+	// Give the dense cells a grid of their own, over the cell's box and
+	// the primitives referenced by the cell. The nested grids are appended
+	// to grids, so the top level is looked up by index.
+	int cells = grids[0].res[0] * grids[0].res[1] * grids[0].res[2];
+	vector<Intersectable*> cellObjects;
+	vector<AABB> cellBoxes;
+	for (int z = 0; z < grids[0].res[2]; ++z){
+		for (int y = 0; y < grids[0].res[1]; ++y){
+			for (int x = 0; x < grids[0].res[0]; ++x){
+				int c = cellIndex(grids[0], x, y, z);
+				unsigned int first = grids[0].cellStart[c];
+				unsigned int count = grids[0].cellStart[c + 1] - first;
+				if ((int)count <= nestedThreshold)
+					continue;
+
+				cellObjects.assign(grids[0].refs.begin() + first, grids[0].refs.begin() + first + count);
+				cellBoxes.resize(count);
+				for (unsigned int i = 0; i < count; ++i)
+					cellObjects[i]->getAABB(cellBoxes[i]);
+
+				const Grid& top = grids[0];
+				Point3D lo(top.bmin[0] + x * top.cellSize[0], top.bmin[1] + y * top.cellSize[1], top.bmin[2] + z * top.cellSize[2]);
+				Point3D hi(lo.x + top.cellSize[0], lo.y + top.cellSize[1], lo.z + top.cellSize[2]);
+
+				if (grids[0].subgrid.empty())
+					grids[0].subgrid.assign(cells, -1);
+				grids[0].subgrid[c] = (int)grids.size();
+				grids.push_back(Grid());
+				buildGrid(grids.back(), cellObjects, cellBoxes, AABB(lo, hi));
+			}
+		}
+	}
+}
+
+/**
+ * Sets up the resolution of grid over bounds and fills its cells with
+ * the objects whose boxes overlap them. The cells get roughly density
+ * times as many cells as there are objects, shaped as close to cubes as
+ * the resolution limit allows. The references are counted in a first
+ * pass and stored contiguously per cell in a second one.
+ */
+void GridAccelerator::buildGrid(Grid& grid, const vector<Intersectable*>& objects, const vector<AABB>& boxes, const AABB& bounds)
+{
+	float maxExtent = 0.0f;
+	for (int k = 0; k < 3; ++k)
+		maxExtent = std::max(maxExtent, bounds.mMax(k) - bounds.mMin(k));
+	if (maxExtent <= 0.0f)
+		maxExtent = 1.0f;
+
+	float extent[3];
+	for (int k = 0; k < 3; ++k){
+		// Flat scenes still need some thickness for the DDA.
+		float pad = std::max(0.0f, minRelativeExtent * maxExtent - (bounds.mMax(k) - bounds.mMin(k))) * 0.5f;
+		grid.bmin[k] = bounds.mMin(k) - pad;
+		grid.bmax[k] = bounds.mMax(k) + pad;
+		extent[k] = grid.bmax[k] - grid.bmin[k];
+	}
+
+	float cellsPerLength = pow(density * objects.size() / (extent[0] * extent[1] * extent[2]), 1.0f / 3.0f);
+	for (int k = 0; k < 3; ++k){
+		grid.res[k] = std::min(std::max((int)(extent[k] * cellsPerLength), 1), maxResolution);
+		grid.cellSize[k] = extent[k] / grid.res[k];
+		grid.invCellSize[k] = grid.res[k] / extent[k];
+	}
+
+	int cells = grid.res[0] * grid.res[1] * grid.res[2];
+	grid.cellStart.assign(cells + 1, 0);
+	grid.subgrid.clear();
+
+	// Cell ranges overlapped by each box, stored as lo/hi per axis.
+	vector<int> ranges(objects.size() * 6);
+	for (size_t i = 0; i < objects.size(); ++i){
+		int* r = &ranges[i * 6];
+		for (int k = 0; k < 3; ++k){
+			r[k] = (int)((boxes[i].mMin(k) - grid.bmin[k]) * grid.invCellSize[k]);
+			r[k + 3] = (int)((boxes[i].mMax(k) - grid.bmin[k]) * grid.invCellSize[k]);
+			r[k] = std::min(std::max(r[k], 0), grid.res[k] - 1);
+			r[k + 3] = std::min(std::max(r[k + 3], 0), grid.res[k] - 1);
+		}
+		for (int z = r[2]; z <= r[5]; ++z)
+			for (int y = r[1]; y <= r[4]; ++y)
+				for (int x = r[0]; x <= r[3]; ++x)
+					grid.cellStart[cellIndex(grid, x, y, z) + 1]++;
+	}
+
+	for (int c = 0; c < cells; ++c)
+		grid.cellStart[c + 1] += grid.cellStart[c];
+
+	grid.refs.resize(grid.cellStart[cells]);
+	vector<unsigned int> cursor(grid.cellStart.begin(), grid.cellStart.end() - 1);
+	for (size_t i = 0; i < objects.size(); ++i){
+		const int* r = &ranges[i * 6];
+		for (int z = r[2]; z <= r[5]; ++z)
+			for (int y = r[1]; y <= r[4]; ++y)
+				for (int x = r[0]; x <= r[3]; ++x)
+					grid.refs[cursor[cellIndex(grid, x, y, z)]++] = objects[i];
+	}
+}
+
+/**
+ * Walks the cells of grid number gridIndex pierced by the ray between
+ * tmin and tmax with a 3D-DDA, nearest cell first. If is is given, the
+ * closest hit is searched for: hits shorten ray.maxT, and the walk stops
+ * once the closest hit lies within the current cell. Otherwise the first
+ * primitive that blocks the ray is returned.
+ */
+Intersectable* GridAccelerator::traverse(int gridIndex, Ray& ray, float tmin, float tmax, Intersection* is, bool& hit, TraversalStats& stats)
+{
+	const Grid& grid = grids[gridIndex];
+
+	stats.testBoxes(1);
+	float t0 = tmin;
+	float t1 = tmax;
+	for (int k = 0; k < 3; ++k){
+		float tNear = (grid.bmin[k] - ray.orig(k)) * ray.invDir(k);
+		float tFar = (grid.bmax[k] - ray.orig(k)) * ray.invDir(k);
+		if (ray.sign[k])
+			std::swap(tNear, tFar);
+		t0 = std::max(t0, tNear);
+		t1 = std::min(t1, tFar);
+	}
+	if (t0 > t1)
+		return 0;
+
+	int cell[3], step[3], stop[3];
+	float tNext[3], tDelta[3];
+	for (int k = 0; k < 3; ++k){
+		float p = ray.orig(k) + ray.dir(k) * t0;
+		cell[k] = std::min(std::max((int)((p - grid.bmin[k]) * grid.invCellSize[k]), 0), grid.res[k] - 1);
+		if (ray.dir(k) > 0.0f){
+			step[k] = 1;
+			stop[k] = grid.res[k];
+			tNext[k] = (grid.bmin[k] + (cell[k] + 1) * grid.cellSize[k] - ray.orig(k)) * ray.invDir(k);
+			tDelta[k] = grid.cellSize[k] * ray.invDir(k);
+		}
+		else if (ray.dir(k) < 0.0f){
+			step[k] = -1;
+			stop[k] = -1;
+			tNext[k] = (grid.bmin[k] + cell[k] * grid.cellSize[k] - ray.orig(k)) * ray.invDir(k);
+			tDelta[k] = -grid.cellSize[k] * ray.invDir(k);
+		}
+		else{
+			step[k] = 0;
+			stop[k] = -1;
+			tNext[k] = INF;
+			tDelta[k] = INF;
+		}
+	}
+
+	float tEnter = t0;
+	for (;;){
+		int c = cellIndex(grid, cell[0], cell[1], cell[2]);
+		int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+		float tExit = std::min(tNext[axis], t1);
+		stats.visitNode();
+
+		if (!grid.subgrid.empty() && grid.subgrid[c] >= 0){
+			Intersectable* occluder = traverse(grid.subgrid[c], ray, tEnter, tExit, is, hit, stats);
+			if (occluder)
+				return occluder;
+		}
+		else{
+			for (unsigned int i = grid.cellStart[c]; i < grid.cellStart[c + 1]; ++i){
+				Intersectable* obj = grid.refs[i];
+				stats.testPrimitive();
+				if (is){
+					if (obj->intersect(ray, *is)){
+						ray.maxT = is->mHitTime;
+						hit = true;
+					}
+				}
+				else if (obj->intersect(ray)){
+					return obj;
+				}
+			}
+		}
+
+		// Hits in later cells can not be closer than one inside this cell.
+		if (hit && ray.maxT <= tExit)
+			return 0;
+		if (tNext[axis] > std::min(t1, ray.maxT))
+			return 0;
+		cell[axis] += step[axis];
+		if (cell[axis] == stop[axis])
+			return 0;
+		tEnter = tNext[axis];
+		tNext[axis] += tDelta[axis];
+	}
+}
+
+bool GridAccelerator::intersect(const Ray& ray)
+{
+	return findOccluder(ray) != 0;
+}
+
+/**
+ * Returns the first primitive found to block the ray.
+ */
+Intersectable* GridAccelerator::findOccluder(const Ray& ray)
+{
+	TraversalStats stats(ray, true);
+	if (grids.empty())
+		return 0;
+	Ray rayCopy(ray);
+	bool hit = false;
+	return traverse(0, rayCopy, ray.minT, ray.maxT, 0, hit, stats);
+}
+
+/**
+ * Finds the closest hit along the ray.
+ */
+bool GridAccelerator::intersect(const Ray& ray, Intersection& is)
+{
+	TraversalStats stats(ray, false);
+	if (grids.empty())
+		return false;
+	Ray rayCopy(ray);
+	bool hit = false;
+	traverse(0, rayCopy, ray.minT, ray.maxT, &is, hit, stats);
+	return hit;
+}
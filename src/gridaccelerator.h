@@ -0,0 +1,72 @@
+/*
+*  gridaccelerator.h
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#ifndef GRIDACCELERATOR_H
+#define GRIDACCELERATOR_H
+
+#include "rayaccelerator.h"
+
+class TraversalStats;
+
+/**
+ * Ray accelerator using a uniform grid. The resolution is chosen so that
+ * the number of cells is proportional to the number of primitives, and
+ * each primitive is referenced by every cell its bounding box overlaps.
+ * The build runs in linear time, which makes the grid a good fit for
+ * scenes of many small, evenly distributed primitives. Rays walk the
+ * cells front-to-back with a 3D-DDA. Optionally, cells holding many
+ * primitives get a nested grid of their own, one level deep.
+ */
+class GridAccelerator : public RayAccelerator
+{
+private:
+	/// One level of the grid. The references of cell c are
+	/// refs[cellStart[c]] to refs[cellStart[c + 1] - 1].
+	struct Grid {
+		float bmin[3];		///< Minimum corner of the grid.
+		float bmax[3];		///< Maximum corner of the grid.
+		int res[3];			///< Number of cells along each axis.
+		float cellSize[3];
+		float invCellSize[3];
+		std::vector<unsigned int> cellStart;
+		std::vector<Intersectable*> refs;
+		std::vector<int> subgrid;	///< Index of the nested grid of each cell, -1 if none. Empty if no cell has one.
+	};
+
+	std::vector<Grid> grids;	///< Top level grid first, followed by the nested grids.
+	float density;				///< Target number of cells per primitive.
+	bool nested;
+	int nestedThreshold;		///< Cells with more references than this get a nested grid.
+
+	void buildGrid(Grid& grid, const std::vector<Intersectable*>& objects, const std::vector<AABB>& boxes, const AABB& bounds);
+	int cellIndex(const Grid& grid, int x, int y, int z) const { return (z * grid.res[1] + y) * grid.res[0] + x; }
+	Intersectable* traverse(int gridIndex, Ray& ray, float tmin, float tmax, Intersection* is, bool& hit, TraversalStats& stats);
+
+public:
+	GridAccelerator(bool nested = false);
+
+	/**
+	 * Sets the target number of cells per primitive, the default is 2.
+	 * Higher densities give fewer primitives per cell at the cost of more
+	 * cell steps and memory.
+	 */
+	void setDensity(float d) { density = d; }
+
+	/**
+	 * Sets the number of references above which a cell gets a nested grid,
+	 * the default is 16. Only used if nested grids are enabled.
+	 */
+	void setNestedThreshold(int n) { nestedThreshold = n; }
+
+	virtual void build(const std::vector<Intersectable*>& objects);
+	virtual bool intersect(const Ray& ray);
+	virtual Intersectable* findOccluder(const Ray& ray);
+	virtual bool intersect(const Ray& ray, Intersection& is);
+};
+
+#endif
@@ -13,6 +13,7 @@
 #include "ray.h"
 #include "aabb.h"
 #include "intersection.h"
+#include <algorithm>
 	
 /**
  * Interface that needs to be implemented by all intersectable primitives
@@ -23,6 +24,9 @@
  * all necessary data and stores it in the supplied Intersection object.
  * Note that this function is slower than the simple form, and should only be
  * used if the additional information is needed.
+ * The splitAABB() function is used by the spatial split BVH builder. The
+ * default implementation splits the bounding box, primitives that can
+ * compute tighter bounds of their parts (such as Triangle) override it.
  */
 class Intersectable
 {
@@ -31,6 +35,24 @@ public:
 	virtual bool intersect(const Ray& ray) const = 0;
 	virtual bool intersect(const Ray& ray, Intersection& is) const = 0;
 	virtual void getAABB(AABB& bb) const = 0;
+	virtual void splitAABB(int axis, float position, AABB& left, AABB& right) const
+	{
+		getAABB(left);
+		right = left;
+		left.mMax(axis) = std::min(left.mMax(axis), position);
+		right.mMin(axis) = std::max(right.mMin(axis), position);
+	}
+};
+
+/**
+ * Interface of the intersectable primitives that report themselves as the
+ * hit object in Intersection::mObject, and compute the differentials at
+ * their hit points. Containers of other primitives, such as MeshInstance,
+ * only implement Intersectable and report the hit primitive instead.
+ */
+class Surface : public Intersectable
+{
+public:
 	virtual UV calculateTextureDifferential(const Point3D& p, const Vector3D& dp) const = 0;
 	virtual Vector3D calculateNormalDifferential(const Point3D& p, const Vector3D& dp, bool isFrontFacing) const = 0;
 };
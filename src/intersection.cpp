@@ -9,6 +9,7 @@
 
 #include "intersection.h"
 #include "intersectable.h"
+#include "meshinstance.h"
 #include <cmath>
 
 Ray::Differential Intersection::calculatePositionDifferential() const
@@ -30,6 +31,17 @@ Ray::Differential Intersection::calculatePositionDifferential() const
 	return dp;
 }
 
+/**
+ * Returns the differential of the normal along the position differential dp.
+ * Instanced objects work in object space, so the instance transforms it.
+ */
+Vector3D Intersection::calculateNormalDifferential(const Vector3D& dp) const
+{
+	if (mInstance)
+		return mInstance->transformNormalDifferential(*this, dp);
+	return mObject->calculateNormalDifferential(mPosition, dp, mFrontFacing);
+}
+
 Ray Intersection::getReflectedRay() const
 {
 	const Vector3D& D = mRay.dir;
@@ -44,10 +56,10 @@ Ray Intersection::getReflectedRay() const
 
 	float dDotN = D.dot(N);
 	
-	dn = mObject->calculateNormalDifferential(mPosition, dp.dx, mFrontFacing);
+	dn = calculateNormalDifferential(dp.dx);
 	dd.dx = mRay.dd.dx - 2.0f*(dDotN*dn + (mRay.dd.dx.dot(N) + D.dot(dn))*N);
 	
-	dn = mObject->calculateNormalDifferential(mPosition, dp.dy, mFrontFacing);
+	dn = calculateNormalDifferential(dp.dy);
 	dd.dy = mRay.dd.dy - 2.0f*(dDotN*dn + (mRay.dd.dy.dot(N) + D.dot(dn))*N);
 
 	return Ray(mPosition + N*0.001f, R, dp, dd);
@@ -84,11 +96,11 @@ Ray Intersection::getRefractedRay() const
 	float dmu;
 	float dmu0 = (eta - eta*eta*D.dot(N) / T.dot(N));
 
-	dn = mObject->calculateNormalDifferential(mPosition, dp.dx, mFrontFacing);
+	dn = calculateNormalDifferential(dp.dx);
 	dmu = dmu0 * (mRay.dd.dx.dot(N) + D.dot(dn));
 	dd.dx = eta*mRay.dd.dx - (mu*dn + dmu*N);
 	
-	dn = mObject->calculateNormalDifferential(mPosition, dp.dy, mFrontFacing);
+	dn = calculateNormalDifferential(dp.dy);
 	dmu = dmu0 * (mRay.dd.dy.dot(N) + D.dot(dn));
 	dd.dy = eta*mRay.dd.dy - (mu*dn + dmu*N);
 
@@ -14,8 +14,9 @@
 #include "ray.h"
 #include "pointlight.h"
 
-class Intersectable;
+class Surface;
 class Material;
+class MeshInstance;
 
 /**
  * Class representing a ray/object intersection point. 
@@ -26,7 +27,7 @@ class Intersection
 {
 public:
 	Ray mRay;						///< A copy of the ray causing the intersection.
-	const Intersectable* mObject;	///< Pointer to the object hit by the ray.
+	const Surface* mObject;			///< Pointer to the object hit by the ray.
 	Material* mMaterial;			///< Pointer to the material at the hit point.
 	Point3D mPosition;				///< Position of hit point in world coordinates.
 	Vector3D mNormal;				///< Normal at hit point.
@@ -35,11 +36,13 @@ public:
 	UV mTexture;					///< Texture coordinate (u,v) at hit point.
 	UV mHitParam;					///< Parametric description of hit point (u,v).
 	float mHitTime;					///< Hit time along ray.
+	const MeshInstance* mInstance;	///< Instance mObject belongs to, or 0 if it is not instanced.
 
 public:
-	Intersection() : mObject(0), mMaterial(0) { }
+	Intersection() : mObject(0), mMaterial(0), mInstance(0) { }
 	
 	Ray::Differential calculatePositionDifferential() const;
+	Vector3D calculateNormalDifferential(const Vector3D& dp) const;
 	Ray getReflectedRay() const;
 	Ray getRefractedRay() const;
 	Ray getShadowRay(PointLight *light) const;
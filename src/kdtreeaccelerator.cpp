@@ -0,0 +1,462 @@
+/*
+*  kdtreeaccelerator.cpp
+*  prTracer
+*
+*/
+
+#include "kdtreeaccelerator.h"
+#include "traversalstack.h"
+#include "raystats.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+/// Cost of traversing an interior node.
+static const float kdTraversalCost = 15.0f;
+/// Cost of intersecting one primitive.
+static const float kdIntersectCost = 20.0f;
+/// Factor applied to the cost of splits that cut off empty space.
+static const float kdEmptyBonus = 0.8f;
+
+/// Side of the split plane a primitive ends up on during the build.
+enum { SIDE_LEFT, SIDE_RIGHT, SIDE_BOTH };
+
+/// Stack entry of the kd-tree traversal: a node and the ray segment inside it.
+struct KdStackItem {
+	unsigned int node;
+	float tmin;
+	float tmax;
+};
+
+// Each level of the tree pushes at most one far child.
+typedef TraversalStack<KdStackItem, KdTreeAccelerator::maxDepth> KdNodeStack;
+
+/// SAH cost of a split with probabilities pl and pr of hitting the children.
+static inline float splitCost(float pl, float pr, int nl, int nr)
+{
+	float cost = kdTraversalCost + kdIntersectCost * (pl * nl + pr * nr);
+	return (nl == 0 || nr == 0) ? cost * kdEmptyBonus : cost;
+}
+
+KdTreeAccelerator::KdTreeAccelerator(bool stackless) : stackless(stackless), treeDepth(0)
+{
+}
+
+void KdTreeAccelerator::build(const vector<Intersectable*>& objects)
+{
+	objs = objects;
+	refs.clear();
+	nodes.clear();
+	treeDepth = 0;
+	bounds = AABB();
+	if (objs.empty())
+		return;
+
+	unsigned int count = (unsigned int)objs.size();
+	vector<AABB> boxes(count);
+	for (unsigned int i = 0; i < count; ++i){
+		objs[i]->getAABB(boxes[i]);
+		bounds.include(boxes[i]);
+	}
+
+	EventList events[3];
+	for (int k = 0; k < 3; ++k)
+		events[k].reserve(2 * count);
+	for (unsigned int i = 0; i < count; ++i)
+		addEvents(events, i, boxes[i]);
+	for (int k = 0; k < 3; ++k)
+		sort(events[k].begin(), events[k].end());
+	vector<AABB>().swap(boxes);
+
+	sides.resize(count);
+	straddling.resize(count);
+	int maxTreeDepth = std::min(maxDepth - 1, (int)(8.0f + 1.3f * log((float)count) / log(2.0f)));
+	buildNode(events, count, bounds, 0, maxTreeDepth);
+
+	vector<unsigned char>().swap(sides);
+	vector<AABB>().swap(straddling);
+}
+
+/**
+ * Appends the events of box to the three event lists: a start and an end
+ * event along each axis, or a planar event if the box is flat along it.
+ */
+void KdTreeAccelerator::addEvents(EventList* events, unsigned int prim, const AABB& box)
+{
+	for (int k = 0; k < 3; ++k){
+		if (box.mMin(k) == box.mMax(k)){
+			Event e = { box.mMin(k), prim, Event::PLANAR };
+			events[k].push_back(e);
+		}
+		else{
+			Event start = { box.mMin(k), prim, Event::START };
+			Event end = { box.mMax(k), prim, Event::END };
+			events[k].push_back(start);
+			events[k].push_back(end);
+		}
+	}
+}
+
+/**
+ * Builds the subtree over the count primitives described by the sorted
+ * event lists, inside box. The best plane along each axis is found in a
+ * single sweep over its events, keeping count of the primitives that lie
+ * below, on and above the candidate plane. The lists of the children are
+ * the parent's lists split by side, which keeps them sorted, merged with
+ * the newly sorted events of the primitives that straddle the plane.
+ * The parent's lists are freed before recursing.
+ */
+void KdTreeAccelerator::buildNode(EventList* events, int count, const AABB& box, int depth, int maxTreeDepth)
+{
+	unsigned int index = (unsigned int)nodes.size();
+	nodes.push_back(KdNode());
+	treeDepth = std::max(treeDepth, depth);
+	if (count <= 1 || depth >= maxTreeDepth){
+		makeLeaf(index, events);
+		return;
+	}
+
+	float invArea = 1.0f / box.getArea();
+	float bestCost = INF;
+	int bestAxis = -1;
+	float bestPos = 0.0f;
+	bool planarLeft = false;
+	for (int k = 0; k < 3; ++k){
+		const EventList& e = events[k];
+		int nl = 0;
+		int nr = count;
+		for (size_t i = 0; i < e.size();){
+			float p = e[i].pos;
+			int ends = 0, planars = 0, starts = 0;
+			while (i < e.size() && e[i].pos == p && e[i].type == Event::END){
+				++ends;
+				++i;
+			}
+			while (i < e.size() && e[i].pos == p && e[i].type == Event::PLANAR){
+				++planars;
+				++i;
+			}
+			while (i < e.size() && e[i].pos == p && e[i].type == Event::START){
+				++starts;
+				++i;
+			}
+
+			nr -= ends + planars;
+			if (p > box.mMin(k) && p < box.mMax(k)){
+				AABB below = box;
+				AABB above = box;
+				below.mMax(k) = p;
+				above.mMin(k) = p;
+				float pl = below.getArea() * invArea;
+				float pr = above.getArea() * invArea;
+
+				// Primitives lying in the plane may go to either side.
+				float cost = splitCost(pl, pr, nl + planars, nr);
+				if (cost < bestCost){
+					bestCost = cost;
+					bestAxis = k;
+					bestPos = p;
+					planarLeft = true;
+				}
+				cost = splitCost(pl, pr, nl, nr + planars);
+				if (cost < bestCost){
+					bestCost = cost;
+					bestAxis = k;
+					bestPos = p;
+					planarLeft = false;
+				}
+			}
+			nl += starts + planars;
+		}
+	}
+
+	if (bestAxis < 0 || bestCost >= kdIntersectCost * count){
+		makeLeaf(index, events);
+		return;
+	}
+
+	// Classify the primitives by their events along the split axis.
+	const EventList& splitEvents = events[bestAxis];
+	for (size_t i = 0; i < splitEvents.size(); ++i)
+		sides[splitEvents[i].prim] = SIDE_BOTH;
+	for (size_t i = 0; i < splitEvents.size(); ++i){
+		const Event& e = splitEvents[i];
+		if (e.type == Event::END && e.pos <= bestPos)
+			sides[e.prim] = SIDE_LEFT;
+		else if (e.type == Event::START && e.pos >= bestPos)
+			sides[e.prim] = SIDE_RIGHT;
+		else if (e.type == Event::PLANAR){
+			if (e.pos < bestPos || (e.pos == bestPos && planarLeft))
+				sides[e.prim] = SIDE_LEFT;
+			else
+				sides[e.prim] = SIDE_RIGHT;
+		}
+	}
+
+	// Recover the current boxes of the straddling primitives from the events.
+	for (int k = 0; k < 3; ++k){
+		for (size_t i = 0; i < events[k].size(); ++i){
+			const Event& e = events[k][i];
+			if (sides[e.prim] != SIDE_BOTH)
+				continue;
+			if (e.type != Event::END)
+				straddling[e.prim].mMin(k) = e.pos;
+			if (e.type != Event::START)
+				straddling[e.prim].mMax(k) = e.pos;
+		}
+	}
+
+	AABB belowBox = box;
+	AABB aboveBox = box;
+	belowBox.mMax(bestAxis) = bestPos;
+	aboveBox.mMin(bestAxis) = bestPos;
+
+	int nl = 0, nr = 0;
+	EventList newLeft[3], newRight[3];
+	for (size_t i = 0; i < splitEvents.size(); ++i){
+		const Event& e = splitEvents[i];
+		if (e.type == Event::END)
+			continue;
+		if (sides[e.prim] == SIDE_LEFT)
+			++nl;
+		else if (sides[e.prim] == SIDE_RIGHT)
+			++nr;
+		else{
+			AABB left, right;
+			objs[e.prim]->splitAABB(bestAxis, bestPos, left, right);
+			left.clip(straddling[e.prim]);
+			right.clip(straddling[e.prim]);
+			if (!left.isEmpty()){
+				addEvents(newLeft, e.prim, left);
+				++nl;
+			}
+			if (!right.isEmpty()){
+				addEvents(newRight, e.prim, right);
+				++nr;
+			}
+		}
+	}
+
+	EventList left[3], right[3];
+	for (int k = 0; k < 3; ++k){
+		EventList leftOnly, rightOnly;
+		for (size_t i = 0; i < events[k].size(); ++i){
+			const Event& e = events[k][i];
+			if (sides[e.prim] == SIDE_LEFT)
+				leftOnly.push_back(e);
+			else if (sides[e.prim] == SIDE_RIGHT)
+				rightOnly.push_back(e);
+		}
+		EventList().swap(events[k]);
+
+		sort(newLeft[k].begin(), newLeft[k].end());
+		sort(newRight[k].begin(), newRight[k].end());
+		left[k].resize(leftOnly.size() + newLeft[k].size());
+		right[k].resize(rightOnly.size() + newRight[k].size());
+		merge(leftOnly.begin(), leftOnly.end(), newLeft[k].begin(), newLeft[k].end(), left[k].begin());
+		merge(rightOnly.begin(), rightOnly.end(), newRight[k].begin(), newRight[k].end(), right[k].begin());
+	}
+
+	buildNode(left, nl, belowBox, depth + 1, maxTreeDepth);
+	nodes[index].initInterior(bestAxis, bestPos, (unsigned int)nodes.size());
+	buildNode(right, nr, aboveBox, depth + 1, maxTreeDepth);
+}
+
+/**
+ * Turns node index into a leaf referencing the primitives of the event
+ * lists. Every primitive has exactly one start or planar event per axis.
+ */
+void KdTreeAccelerator::makeLeaf(unsigned int index, const EventList* events)
+{
+	unsigned int offset = (unsigned int)refs.size();
+	for (size_t i = 0; i < events[0].size(); ++i){
+		if (events[0][i].type != Event::END)
+			refs.push_back(objs[events[0][i].prim]);
+	}
+	nodes[index].initLeaf(offset, (unsigned int)refs.size() - offset);
+}
+
+/**
+ * Clips the ray's [minT, maxT] interval to the bounds of the tree.
+ */
+bool KdTreeAccelerator::intersectBounds(const Ray& ray, float& tmin, float& tmax) const
+{
+	float t0 = ray.minT;
+	float t1 = ray.maxT;
+	for (int k = 0; k < 3; ++k){
+		float tNear = (bounds.mMin(k) - ray.orig(k)) * ray.invDir(k);
+		float tFar = (bounds.mMax(k) - ray.orig(k)) * ray.invDir(k);
+		if (ray.sign[k])
+			std::swap(tNear, tFar);
+		t0 = std::max(t0, tNear);
+		t1 = std::min(t1, tFar);
+	}
+	tmin = t0;
+	tmax = t1;
+	return t0 <= t1;
+}
+
+/**
+ * Walks the leaves pierced by the ray front-to-back, keeping the far
+ * children that the ray segment also passes on a stack. If is is given,
+ * the closest hit is searched for and ray.maxT is shortened by each hit,
+ * which culls the stacked nodes that start beyond it. Otherwise the first
+ * primitive that blocks the ray is returned.
+ */
+Intersectable* KdTreeAccelerator::traverse(Ray& ray, Intersection* is, bool& hit, TraversalStats& stats)
+{
+	float tmin, tmax;
+	stats.testBoxes(1);
+	if (nodes.empty() || !intersectBounds(ray, tmin, tmax))
+		return 0;
+
+	KdNodeStack nodeStack;
+	unsigned int index = 0;
+	for (;;){
+		if (ray.maxT < tmin)
+			return 0;
+
+		const KdNode& node = nodes[index];
+		stats.visitNode();
+		if (!node.isLeaf()){
+			int axis = node.axis();
+			float tSplit = (node.split - ray.orig(axis)) * ray.invDir(axis);
+			bool belowFirst = ray.orig(axis) < node.split || (ray.orig(axis) == node.split && ray.dir(axis) <= 0.0f);
+			unsigned int first = belowFirst ? index + 1 : node.aboveChild();
+			unsigned int second = belowFirst ? node.aboveChild() : index + 1;
+
+			if (tSplit > tmin && tSplit < tmax && tSplit > 0.0f){
+				KdStackItem item = { second, tSplit, tmax };
+				nodeStack.push(item);
+				index = first;
+				tmax = tSplit;
+			}
+			else if (tSplit <= tmin && tSplit > 0.0f)
+				index = second;
+			else
+				index = first;
+			continue;
+		}
+
+		unsigned int end = node.primOffset + node.nPrims();
+		for (unsigned int i = node.primOffset; i < end; ++i){
+			Intersectable* obj = refs[i];
+			stats.testPrimitive();
+			if (is){
+				if (obj->intersect(ray, *is)){
+					ray.maxT = is->mHitTime;
+					hit = true;
+				}
+			}
+			else if (obj->intersect(ray)){
+				return obj;
+			}
+		}
+
+		if (nodeStack.empty())
+			return 0;
+		index = nodeStack.top().node;
+		tmin = nodeStack.top().tmin;
+		tmax = nodeStack.top().tmax;
+		nodeStack.pop();
+	}
+}
+
+/**
+ * Same as traverse(), but without a stack. After each leaf the search
+ * restarts for the rest of the ray, from the deepest node that the whole
+ * remaining segment is known to lie in: the last node reached before the
+ * segment was first cut by a split plane.
+ */
+Intersectable* KdTreeAccelerator::traverseStackless(Ray& ray, Intersection* is, bool& hit, TraversalStats& stats)
+{
+	float tmin, tmax;
+	stats.testBoxes(1);
+	if (nodes.empty() || !intersectBounds(ray, tmin, tmax))
+		return 0;
+
+	unsigned int restart = 0;
+	for (;;){
+		unsigned int index = restart;
+		float t0 = tmin;
+		float t1 = tmax;
+		bool pushDown = true;
+		for (;;){
+			const KdNode& node = nodes[index];
+			stats.visitNode();
+			if (node.isLeaf())
+				break;
+
+			int axis = node.axis();
+			float tSplit = (node.split - ray.orig(axis)) * ray.invDir(axis);
+			bool belowFirst = ray.orig(axis) < node.split || (ray.orig(axis) == node.split && ray.dir(axis) <= 0.0f);
+			unsigned int first = belowFirst ? index + 1 : node.aboveChild();
+			unsigned int second = belowFirst ? node.aboveChild() : index + 1;
+
+			if (tSplit > t0 && tSplit < t1 && tSplit > 0.0f){
+				index = first;
+				t1 = tSplit;
+				pushDown = false;
+			}
+			else{
+				index = (tSplit <= t0 && tSplit > 0.0f) ? second : first;
+				if (pushDown)
+					restart = index;
+			}
+		}
+
+		const KdNode& leaf = nodes[index];
+		unsigned int end = leaf.primOffset + leaf.nPrims();
+		for (unsigned int i = leaf.primOffset; i < end; ++i){
+			Intersectable* obj = refs[i];
+			stats.testPrimitive();
+			if (is){
+				if (obj->intersect(ray, *is)){
+					ray.maxT = is->mHitTime;
+					hit = true;
+				}
+			}
+			else if (obj->intersect(ray)){
+				return obj;
+			}
+		}
+
+		// Done when the leaf reaches the end of the ray, or holds a hit
+		// that no later leaf can beat.
+		if (t1 >= tmax || ray.maxT <= t1)
+			return 0;
+		tmin = t1;
+	}
+}
+
+bool KdTreeAccelerator::intersect(const Ray& ray)
+{
+	return findOccluder(ray) != 0;
+}
+
+/**
+ * Returns the first primitive found to block the ray.
+ */
+Intersectable* KdTreeAccelerator::findOccluder(const Ray& ray)
+{
+	TraversalStats stats(ray, true);
+	Ray rayCopy(ray);
+	bool hit = false;
+	return stackless ? traverseStackless(rayCopy, 0, hit, stats) : traverse(rayCopy, 0, hit, stats);
+}
+
+/**
+ * Finds the closest hit along the ray.
+ */
+bool KdTreeAccelerator::intersect(const Ray& ray, Intersection& is)
+{
+	TraversalStats stats(ray, false);
+	Ray rayCopy(ray);
+	bool hit = false;
+	if (stackless)
+		traverseStackless(rayCopy, &is, hit, stats);
+	else
+		traverse(rayCopy, &is, hit, stats);
+	return hit;
+}
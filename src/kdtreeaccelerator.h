@@ -0,0 +1,93 @@
+/*
+*  kdtreeaccelerator.h
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#ifndef KDTREEACCELERATOR_H
+#define KDTREEACCELERATOR_H
+
+#include "rayaccelerator.h"
+
+class TraversalStats;
+
+/**
+ * Compact 8 byte kd-tree node. The nodes are stored in depth-first order,
+ * so the child below the split plane of an interior node is always the
+ * next node in the array and only the index of the child above is stored.
+ */
+struct KdNode {
+	union {
+		float split;				///< Interior: position of the split plane.
+		unsigned int primOffset;	///< Leaf: index of the first primitive reference.
+	};
+	unsigned int flags;				///< Bits 0-1: split axis, or 3 for leaves. Bits 2-31: index of the child above, or primitive count.
+
+	void initLeaf(unsigned int offset, unsigned int n) { primOffset = offset; flags = (n << 2) | 3; }
+	void initInterior(int axis, float position, unsigned int above) { split = position; flags = (above << 2) | axis; }
+	bool isLeaf() const { return (flags & 3) == 3; }
+	int axis() const { return flags & 3; }
+	unsigned int aboveChild() const { return flags >> 2; }
+	unsigned int nPrims() const { return flags >> 2; }
+};
+
+/**
+ * Ray accelerator using a kd-tree built with the surface area heuristic.
+ * The split candidates are the primitive bounds, swept in sorted order
+ * along each axis. The sorted event lists are split between the children
+ * instead of being sorted again, so the build runs in O(n log n).
+ * Primitives straddling a split plane are clipped to each side with
+ * Intersectable::splitAABB(). The tree is traversed either with a stack,
+ * or without one by restarting from the deepest node known to contain
+ * the rest of the ray after each leaf (kd-restart with push-down).
+ */
+class KdTreeAccelerator : public RayAccelerator
+{
+public:
+	/// Hard limit on the tree depth, the traversal stack is sized from it.
+	static const int maxDepth = 64;
+
+private:
+	/// Start, end or planar extent of a primitive's clipped box along one axis.
+	struct Event {
+		enum Type { END, PLANAR, START };
+
+		float pos;
+		unsigned int prim;
+		Type type;			///< Sorted in declaration order at equal positions.
+
+		bool operator<(const Event& e) const { return pos < e.pos || (pos == e.pos && type < e.type); }
+	};
+	typedef std::vector<Event> EventList;
+
+	std::vector<Intersectable*> objs;	///< Primitives of the current build, indexed by the events.
+	std::vector<Intersectable*> refs;	///< Primitive references of the leaves.
+	std::vector<KdNode> nodes;
+	AABB bounds;
+	bool stackless;
+	int treeDepth;						///< Depth of the deepest leaf in the current tree.
+	std::vector<unsigned char> sides;	///< Build scratch: side of the split plane of each primitive.
+	std::vector<AABB> straddling;		///< Build scratch: clipped box of each primitive straddling the plane.
+
+	static void addEvents(EventList* events, unsigned int prim, const AABB& box);
+	void buildNode(EventList* events, int count, const AABB& box, int depth, int maxTreeDepth);
+	void makeLeaf(unsigned int index, const EventList* events);
+	bool intersectBounds(const Ray& ray, float& tmin, float& tmax) const;
+	Intersectable* traverse(Ray& ray, Intersection* is, bool& hit, TraversalStats& stats);
+	Intersectable* traverseStackless(Ray& ray, Intersection* is, bool& hit, TraversalStats& stats);
+
+public:
+	KdTreeAccelerator(bool stackless = false);
+
+	virtual void build(const std::vector<Intersectable*>& objects);
+	virtual bool intersect(const Ray& ray);
+	virtual Intersectable* findOccluder(const Ray& ray);
+	virtual bool intersect(const Ray& ray, Intersection& is);
+
+	/// Returns the depth of the deepest leaf, the root has depth 0.
+	int getDepth() const { return treeDepth; }
+};
+
+#endif
@@ -15,13 +15,18 @@ void ListAccelerator::build(const std::vector<Intersectable*>& objects)
 }
 
 bool ListAccelerator::intersect(const Ray& ray)
+{
+	return findOccluder(ray) != 0;
+}
+
+Intersectable* ListAccelerator::findOccluder(const Ray& ray)
 {
 	std::vector<Intersectable*>::iterator i;
 	for (i = objects.begin(); i != objects.end(); ++i) {
 		if ((*i)->intersect(ray))
-			return true;
+			return *i;
 	}
-	return false;
+	return 0;
 }
 
 bool ListAccelerator::intersect(const Ray& ray, Intersection& is)
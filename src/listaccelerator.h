@@ -20,6 +20,7 @@ private:
 public:
 	virtual void build(const std::vector<Intersectable*>& objects);
 	virtual bool intersect(const Ray& ray);
+	virtual Intersectable* findOccluder(const Ray& ray);
 	virtual bool intersect(const Ray& ray, Intersection& is);
 };
 
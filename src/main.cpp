@@ -13,6 +13,7 @@
 #include "image.h"
 #include "camera.h"
 #include "mesh.h"
+#include "meshinstance.h"
 #include "sphere.h"
 #include "diffuse.h"
 #include "whittedtracer.h"
@@ -24,6 +25,9 @@
 #include "texture.h"
 #include "phong.h"
 #include "bvhaccelerator.h"
+#include "bvh4accelerator.h"
+#include "gridaccelerator.h"
+#include "kdtreeaccelerator.h"
 #include "cornellscene.h"
 #include <omp.h>
 
@@ -263,7 +267,8 @@ static void buildElephant(Scene& scene)
 	scene.add(plane);
 	Phong *elephantMaterial0 = new Phong(Color(0.4f, 0.7f, 1.0f), 25);
 	elephantMaterial0->setReflectivity(0.55f);
-	Mesh* elephant0 = new Mesh("data/elephant.obj", elephantMaterial0);
+	Mesh* elephant = new Mesh("data/elephant.obj");
+	MeshInstance* elephant0 = new MeshInstance(elephant, elephantMaterial0);
 	elephant0->setScale(1.1f);
 	elephant0->setRotation(0.0f, 220.0f, 0.0f);
 	elephant0->setTranslation(Vector3D(-12, -10, 1));
@@ -272,7 +277,7 @@ static void buildElephant(Scene& scene)
 	elephantMaterial1->setReflectivity(0.20f);
 	elephantMaterial1->setTransparency(0.50f);
 	elephantMaterial1->setIndexOfRefraction(1.1f);
-	Mesh* elephant1 = new Mesh("data/elephant.obj", elephantMaterial1);
+	MeshInstance* elephant1 = new MeshInstance(elephant, elephantMaterial1);
 	elephant1->setScale(1.35f);
 	elephant1->setRotation(0.0f, 190.0f, 0.0f);
 	elephant1->setTranslation(Vector3D(8.0f, -10, -5));
@@ -321,6 +326,11 @@ int main(int argc, char* const argv[])
 
 		// Build scene.
 		BVHAccelerator accelerator;
+		//BVH4Accelerator accelerator;
+		//GridAccelerator accelerator;
+		//KdTreeAccelerator accelerator;
+		//BVHAccelerator accelerator(BVHAccelerator::SPLIT_LBVH);
+		//accelerator.setCacheFile("scene.bvh");
 		Scene scene(&accelerator);
 		Image output(512, 512);
 		Camera* camera = new Camera(&output);
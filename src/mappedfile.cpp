@@ -0,0 +1,102 @@
+/*
+ *  mappedfile.cpp
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile() : mData(0), mSize(0), mFile(INVALID_HANDLE_VALUE), mMapping(0)
+#else
+MappedFile::MappedFile() : mData(0), mSize(0)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+/**
+ * Maps the file into memory, any previous mapping is released first.
+ * Returns false if the file does not exist, is empty or can not be mapped.
+ */
+bool MappedFile::open(const std::string& filename)
+{
+	close();
+#ifdef _WIN32
+	mFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0) {
+		close();
+		return false;
+	}
+	mMapping = CreateFileMappingA(mFile, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mMapping) {
+		close();
+		return false;
+	}
+	mData = (const unsigned char*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+	if (!mData) {
+		close();
+		return false;
+	}
+	mSize = (size_t)size.QuadPart;
+#else
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	void* p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after the descriptor is closed.
+	::close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	mData = (const unsigned char*)p;
+	mSize = (size_t)st.st_size;
+#endif
+	return true;
+}
+
+/**
+ * Releases the mapping.
+ */
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (mData)
+		UnmapViewOfFile(mData);
+	if (mMapping)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+	mMapping = 0;
+	mFile = INVALID_HANDLE_VALUE;
+#else
+	if (mData)
+		munmap((void*)mData, mSize);
+#endif
+	mData = 0;
+	mSize = 0;
+}
@@ -0,0 +1,48 @@
+/*
+ *  mappedfile.h
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+/**
+ * Read-only memory mapping of a whole file. The pages are loaded by the
+ * operating system on first access, so opening a large file is cheap and
+ * only the parts that are read cost any I/O. The mapping is released when
+ * the object is destroyed.
+ */
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const std::string& filename);
+	void close();
+
+	/// Returns a pointer to the first byte of the file, or 0 if not open.
+	const unsigned char* data() const { return mData; }
+
+	/// Returns the size of the file in bytes.
+	size_t size() const { return mSize; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char* mData;		///< Start of the mapping.
+	size_t mSize;					///< Size of the mapping in bytes.
+#ifdef _WIN32
+	void* mFile;					///< File handle.
+	void* mMapping;					///< File mapping handle.
+#endif
+};
+
+#endif
@@ -12,13 +12,14 @@
 #include "defines.h"
 #include "triangle.h"
 #include "mesh.h"
+#include "bvhaccelerator.h"
 
 using namespace std;
 
 /**
  * Creates a mesh primitive.
  */
-Mesh::Mesh() : Primitive()
+Mesh::Mesh() : Primitive(), mInstanceBVH(0), mInstanceCount(0)
 {
 }
 
@@ -26,11 +27,19 @@ Mesh::Mesh() : Primitive()
  * Loads a mesh from the specified file.
  * @param filename Name of the file from which to load the mesh object
  */
-Mesh::Mesh(const std::string& filename, Material* m) : Primitive(m)
+Mesh::Mesh(const std::string& filename, Material* m) : Primitive(m), mInstanceBVH(0), mInstanceCount(0)
 {
 	load(filename);
 }
 
+/**
+ * Destroys the mesh and the BVH shared by its instances.
+ */
+Mesh::~Mesh()
+{
+	delete mInstanceBVH;
+}
+
 /**
  * Loads a mesh from the specified file.
  */
@@ -59,6 +68,11 @@ void Mesh::clear()
 	
 	// clear faces
 	mFaces.clear();
+	mIndices.clear();
+	mFaceMaterials.clear();
+
+	delete mInstanceBVH;
+	mInstanceBVH = 0;
 }
 
 
@@ -178,6 +192,8 @@ void Mesh::loadOBJ(const std::string& filename)
 	mOrigVtxN.reserve(50000);
 	mVtxUV.reserve(50000);
 	mFaces.reserve(50000);
+	mIndices.reserve(150000);
+	mFaceMaterials.reserve(50000);
 	
 	char line[4096];
 	int line_num = 0;
@@ -191,8 +207,8 @@ void Mesh::loadOBJ(const std::string& filename)
 	mp.reset();
 	mMaterials.push_back(CreateMaterial(mp));
 
-	//Material *mtl = mMaterials.front();
-	Material *mtl = 0;
+	//unsigned short mtl = 0;
+	unsigned short mtl = meshMaterial;
 	bool mtlFound = false;
 	
 	//----------- reading starts here -------------
@@ -282,7 +298,9 @@ void Mesh::loadOBJ(const std::string& filename)
 					n++;
 
 					// add triangle to list of triangles
-					mFaces.push_back(Triangle(this,vtx[0],vtx[1],vtx[2], mtl));
+					mFaces.push_back(Triangle(this, (unsigned int)mFaces.size()));
+					mIndices.insert(mIndices.end(), vtx, vtx + 3);
+					mFaceMaterials.push_back(mtl);
 					
 					nFaces++;
 					
@@ -297,6 +315,8 @@ void Mesh::loadOBJ(const std::string& filename)
 		else if (what == "mtllib") { // Parse material file
 			iss >> what;
 			mtlFound = loadMTL(what);
+			if (mMaterials.size() > meshMaterial)
+				throw std::runtime_error("too many materials in "+what);
 		}
 		else if (what == "usemtl") { // Set material
 			if (mtlFound) {
@@ -305,12 +325,12 @@ void Mesh::loadOBJ(const std::string& filename)
 				std::vector<Material *>::iterator itr;
 				for (itr = mMaterials.begin(); itr != mMaterials.end(); ++itr) {
 					if ((*itr)->getName() == what) {
-						mtl = *itr;
+						mtl = (unsigned short)(itr - mMaterials.begin());
 						break;
 					}
 				}
 				if (itr == mMaterials.end())
-					mtl = mMaterials.front();
+					mtl = 0;
 			}
 		}
 		else if(what=="g") { // Group
@@ -346,12 +366,16 @@ void Mesh::loadOBJ(const std::string& filename)
 		mOrigVtxN.resize(nverts);
 		for(int i=0; i<ntris; i++)
 		{
-			Triangle& t = mFaces[i];
-			Vector3D wn = t.getArea() * t.getFaceNormal();
+			// The face normal is computed from the original positions,
+			// since the world space ones are set up later by prepare().
+			Triangle::vertex* vtx = &mIndices[3*i];
+			Vector3D e1 = mOrigVtxP[vtx[1].p] - mOrigVtxP[vtx[0].p];
+			Vector3D e2 = mOrigVtxP[vtx[2].p] - mOrigVtxP[vtx[0].p];
+			Vector3D wn = 0.5f * (e1 % e2);		// area-weighted face normal
 			for(int j=0; j<3; j++)
 			{
-				t.mVtx[j].n = t.mVtx[j].p;
-				mOrigVtxN[ t.mVtx[j].n ] += wn;
+				vtx[j].n = vtx[j].p;
+				mOrigVtxN[ vtx[j].n ] += wn;
 			}
 		}
 		for(int i=0; i<nverts; i++) mOrigVtxN[i].normalize();
@@ -369,7 +393,7 @@ void Mesh::loadOBJ(const std::string& filename)
 		mVtxUV[2] = UV(0,1);
 		for(int i=0; i<ntris; i++)
 			for(int j=0; j<3; j++)
-				mFaces[i].mVtx[j].t = j;
+				mIndices[3*i+j].t = j;
 	}
 	
 	// All done!
@@ -403,9 +427,24 @@ void Mesh::prepare()
 		mVtxN[i] = worldInvT * mOrigVtxN[i];
 		mVtxN[i].normalize();
 	}
-	
-	for (int i = 0; i < (int)mFaces.size(); i++)
-		mFaces[i].prepare();
+}
+
+/**
+ * Returns the BVH used by the mesh's instances. It is built the first time
+ * an instance asks for it, over the triangles in object space, since the
+ * mesh is not part of the scene and keeps the identity world transform.
+ */
+BVHAccelerator* Mesh::getInstanceBVH()
+{
+	if (!mInstanceBVH) {
+		prepare();
+
+		std::vector<Intersectable*> geometry;
+		getGeometry(geometry);
+		mInstanceBVH = new BVHAccelerator();
+		mInstanceBVH->build(geometry);
+	}
+	return mInstanceBVH;
 }
 
 /**
@@ -15,6 +15,7 @@
 #include "triangle.h"
 #include "primitive.h"
 
+class BVHAccelerator;
 
 struct MaterialProperties {	
 	Color ambient;
@@ -58,16 +59,26 @@ struct MaterialProperties {
  * The mesh can be loaded from an WaveFront (.obj) mesh file.
  * Internally, the mesh's vertex positions, normals, and texture
  * coordinates are stored in separate vectors. Each triangle has
- * three sets of indices into these vectors. If the normals are
+ * three sets of indices into these vectors, stored in one shared index
+ * buffer together with a small material id per triangle. If the normals are
  * not specified in the obj-file, these are computed by area-weighting
  * the face normals.
+ * A mesh can either be added to the scene directly, or be shared by any
+ * number of MeshInstance nodes, in which case it is not added itself.
+ * The instances share ownership of such a mesh, it is deleted together
+ * with its last instance.
  */
 class Mesh : public Primitive
 {
 public:
+	/// Material id of triangles that use the mesh's own material.
+	static const unsigned short meshMaterial = 0xffff;
+
 	Mesh();
 	Mesh(const std::string& filename, Material* m=0);
+	virtual ~Mesh();
 	void load(const std::string& filename);
+	BVHAccelerator* getInstanceBVH();
 
 	// TEMP TEMP - Should be protected
 	void getGeometry(std::vector<Intersectable*>& geometry);
@@ -88,9 +99,14 @@ protected:
 	std::vector<Vector3D> mVtxN;		///< Array of vertex normals.
 	std::vector<UV> mVtxUV;				///< Array of vertex UV coordinates.
 	std::vector<Triangle> mFaces;		///< Array of triangles.
+	std::vector<Triangle::vertex> mIndices;		///< Vertex indices, three per triangle.
+	std::vector<unsigned short> mFaceMaterials;	///< Index into mMaterials per triangle, or meshMaterial.
 	std::vector<Material *> mMaterials;	///< Array of materials.
+	BVHAccelerator* mInstanceBVH;		///< Object space BVH shared by the mesh's instances, or 0.
+	int mInstanceCount;					///< Number of MeshInstance nodes sharing the mesh.
 	
 	friend class Triangle;				// Triangle is a friend class so it can access protected data.
+	friend class MeshInstance;			// MeshInstance keeps the instance count.
 };
 
 #endif
@@ -0,0 +1,135 @@
+/*
+ *  meshinstance.cpp
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#include "defines.h"
+#include "meshinstance.h"
+#include "mesh.h"
+#include "bvhaccelerator.h"
+
+/**
+ * Creates an instance of the mesh with material m. The instance takes
+ * shared ownership of the mesh.
+ */
+MeshInstance::MeshInstance(Mesh* mesh, Material* m) : Primitive(m), mMesh(mesh), mBVH(0)
+{
+	if (!mMesh)
+		throw std::runtime_error("(MeshInstance::MeshInstance) mesh is null pointer");
+	mMesh->mInstanceCount++;
+}
+
+/**
+ * Destroys the instance. The shared mesh is deleted with its last instance.
+ */
+MeshInstance::~MeshInstance()
+{
+	if (--mMesh->mInstanceCount == 0)
+		delete mMesh;
+}
+
+/**
+ * Prepare the instance for rendering. The shared BVH is built by the first
+ * instance that is prepared, and the transforms between world and object
+ * space are computed.
+ */
+void MeshInstance::prepare()
+{
+	mBVH = mMesh->getInstanceBVH();
+	mInvWorldTransform = mWorldTransform.inverse();
+	mNormalTransform = mInvWorldTransform.transpose();
+	mWorldTransposed = mWorldTransform.transpose();
+}
+
+/**
+ * The instance itself is intersectable, its triangles are kept in the
+ * shared BVH and not added to the scene.
+ */
+void MeshInstance::getGeometry(std::vector<Intersectable*>& geometry)
+{
+	geometry.push_back(this);
+}
+
+/**
+ * Returns the ray in object space. The direction is not normalized, so
+ * the hit times are the same in world and object space.
+ */
+Ray MeshInstance::getObjectRay(const Ray& ray) const
+{
+	Ray objectRay;
+	objectRay.orig = mInvWorldTransform * ray.orig;
+	objectRay.dir = mInvWorldTransform * ray.dir;
+	objectRay.minT = ray.minT;
+	objectRay.maxT = ray.maxT;
+	objectRay.primary = ray.primary;
+	objectRay.updateTraversalData();
+	return objectRay;
+}
+
+/**
+ * Returns true if the ray intersects the mesh.
+ */
+bool MeshInstance::intersect(const Ray& ray) const
+{
+	return mBVH->intersect(getObjectRay(ray));
+}
+
+/**
+ * Returns true if the ray intersects the mesh. The hit found in object
+ * space is transformed to world space.
+ */
+bool MeshInstance::intersect(const Ray& ray, Intersection& isect) const
+{
+	if (!mBVH->intersect(getObjectRay(ray), isect))
+		return false;
+
+	const Triangle* triangle = static_cast<const Triangle*>(isect.mObject);
+	if (!triangle->getMaterial() && getMaterial())
+		isect.mMaterial = getMaterial();
+
+	isect.mRay = ray;
+	isect.mInstance = this;
+	isect.mPosition = mWorldTransform * isect.mPosition;
+	isect.mNormal = mNormalTransform * isect.mNormal;
+	isect.mNormal.normalize();
+	isect.mView = -ray.dir;
+	return true;
+}
+
+/**
+ * Computes an axis-aligned bounding box enclosing the instance in world
+ * space, from the eight corners of the root box of the shared BVH.
+ */
+void MeshInstance::getAABB(AABB& bb) const
+{
+	bb = AABB();
+	if (mBVH->getNodes().empty())
+		return;
+
+	AABB box = mBVH->getNodes()[0].getAABB();
+	for (int i = 0; i < 8; i++) {
+		Point3D p((i & 1) ? box.mMax.x : box.mMin.x,
+				  (i & 2) ? box.mMax.y : box.mMin.y,
+				  (i & 4) ? box.mMax.z : box.mMin.z);
+		bb.include(mWorldTransform * p);
+	}
+}
+
+/**
+ * Returns the world space normal differential along dp of a hit on this
+ * instance. The hit triangle computes it in object space. World normals
+ * are n' = An/|An|, with A the normal transform, so the differential is
+ * the part of A dn orthogonal to n', divided by |An| = 1/|M^T n'|.
+ */
+Vector3D MeshInstance::transformNormalDifferential(const Intersection& isect, const Vector3D& dp) const
+{
+	Point3D p = mInvWorldTransform * isect.mPosition;
+	Vector3D dn = isect.mObject->calculateNormalDifferential(p, mInvWorldTransform * dp, isect.mFrontFacing);
+
+	Vector3D adn = mNormalTransform * dn;
+	float scale = (mWorldTransposed * isect.mNormal).length();
+	return scale * (adn - isect.mNormal.dot(adn) * isect.mNormal);
+}
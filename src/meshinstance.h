@@ -0,0 +1,57 @@
+/*
+ *  meshinstance.h
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#ifndef MESHINSTANCE_H
+#define MESHINSTANCE_H
+
+#include "primitive.h"
+#include "intersectable.h"
+
+class Mesh;
+class BVHAccelerator;
+
+/**
+ * Class representing an instance of a shared mesh.
+ * The mesh is loaded once and has its own bottom-level BVH over its
+ * triangles in object space (see Mesh::getInstanceBVH()). Each instance
+ * is a single primitive in the scene's top-level accelerator; rays that
+ * reach it are transformed to object space and traced through the shared
+ * BVH, in the same way as Sphere intersects in object space. The mesh
+ * itself must not be added to the scene; the instances share ownership of
+ * it and the last one deletes it.
+ *
+ * Hits report the triangle as the hit object. Triangles without a material
+ * of their own use the instance's material, if set, before the mesh's.
+ */
+class MeshInstance : public Primitive, public Intersectable
+{
+public:
+	MeshInstance(Mesh* mesh, Material* m=0);
+	virtual ~MeshInstance();
+
+	// Implementation of the Intersectable interface.
+	bool intersect(const Ray& ray) const;
+	bool intersect(const Ray& ray, Intersection& isect) const;
+	void getAABB(AABB& bb) const;
+
+	Vector3D transformNormalDifferential(const Intersection& isect, const Vector3D& dp) const;
+
+protected:
+	void prepare();
+	void getGeometry(std::vector<Intersectable*>& geometry);
+	Ray getObjectRay(const Ray& ray) const;
+
+protected:
+	Mesh* mMesh;					///< The shared mesh.
+	BVHAccelerator* mBVH;			///< The mesh's object space BVH.
+	Matrix mInvWorldTransform;		///< World->Object transform.
+	Matrix mNormalTransform;		///< Object->World transform of normals (inverse transpose).
+	Matrix mWorldTransposed;		///< Transpose of the Object->World transform.
+};
+
+#endif
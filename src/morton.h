@@ -0,0 +1,97 @@
+/*
+ *  morton.h
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <vector>
+#include "aabb.h"
+
+/// Number of bits per axis in a Morton code.
+static const int mortonBitsPerAxis = 10;
+
+/// Spreads the lower 10 bits of v so that there are two zero bits between each bit.
+inline unsigned int expandMortonBits(unsigned int v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+/**
+ * Returns the 30-bit Morton code of p, quantized to a 1024^3 grid over
+ * bounds. The bits are interleaved as ...zyxzyx, so bit b of the code
+ * splits along axis b % 3.
+ */
+inline unsigned int encodeMorton(const Point3D& p, const AABB& bounds)
+{
+	unsigned int q[3];
+	for (int i = 0; i < 3; ++i) {
+		float extent = bounds.mMax(i) - bounds.mMin(i);
+		float f = extent > 0.0f ? (p(i) - bounds.mMin(i)) / extent : 0.0f;
+		int v = (int)(f * (1 << mortonBitsPerAxis));
+		q[i] = v < 0 ? 0 : (v > (1 << mortonBitsPerAxis) - 1 ? (1 << mortonBitsPerAxis) - 1 : v);
+	}
+	return expandMortonBits(q[0]) | (expandMortonBits(q[1]) << 1) | (expandMortonBits(q[2]) << 2);
+}
+
+/**
+ * Returns the index of the highest bit where the Morton codes a and b
+ * differ, or -1 if they are equal.
+ */
+inline int highestDifferingBit(unsigned int a, unsigned int b)
+{
+	unsigned int x = a ^ b;
+	int bit = -1;
+	while (x) {
+		x >>= 1;
+		++bit;
+	}
+	return bit;
+}
+
+/**
+ * Sorts items by their 30-bit Morton codes with a least significant digit
+ * radix sort, three passes of 10 bits. Both arrays are reordered.
+ */
+template<class T>
+void radixSortMorton(std::vector<T>& items, std::vector<unsigned int>& codes)
+{
+	const int bitsPerPass = 10;
+	const int buckets = 1 << bitsPerPass;
+	size_t n = items.size();
+	std::vector<T> tmpItems(n);
+	std::vector<unsigned int> tmpCodes(n);
+	std::vector<size_t> offsets(buckets);
+
+	for (int pass = 0; pass < 3; ++pass) {
+		int shift = pass * bitsPerPass;
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for (size_t i = 0; i < n; ++i)
+			offsets[(codes[i] >> shift) & (buckets - 1)]++;
+
+		size_t sum = 0;
+		for (int b = 0; b < buckets; ++b) {
+			size_t c = offsets[b];
+			offsets[b] = sum;
+			sum += c;
+		}
+
+		for (size_t i = 0; i < n; ++i) {
+			size_t dst = offsets[(codes[i] >> shift) & (buckets - 1)]++;
+			tmpItems[dst] = items[i];
+			tmpCodes[dst] = codes[i];
+		}
+		items.swap(tmpItems);
+		codes.swap(tmpCodes);
+	}
+}
+
+#endif
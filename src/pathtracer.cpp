@@ -15,12 +15,17 @@
 #include "material.h"
 #include "pathtracer.h"
 #include "timer.h"
+#include "raystats.h"
 #include "image.h"
 #include "lightprobe.h"
+#include "raypacket.h"
+#include "morton.h"
+#include "pointlight.h"
+#include "sampler.h"
 #include <omp.h>
+#include <algorithm>
 
 const float nbrSamples = 100.0;
-const float samplesPerAxis = 10.0;
 const int iSamplesPerAxis = 10;
 const bool sampling = true;
 const int maxDepth = 4;
@@ -31,7 +36,7 @@ LightProbe lp;
 /**
  * Creates a Path raytracer. The parameters are passed on to the base class constructor.
  */
-PathTracer::PathTracer(Scene* scene, Image* img) : Raytracer(scene,img)
+PathTracer::PathTracer(Scene* scene, Image* img) : Raytracer(scene,img), mWavefront(false), mWavefrontSize(65536)
 {
 	lp.load("data/grace_probe.pfm");
 }
@@ -42,53 +47,41 @@ PathTracer::~PathTracer()
 }
 
 /**
- * Raytraces the scene by calling tracePixel() for each pixel in the output image.
- * The function tracePixel() is responsible for computing the output color of the
- * pixel. This should be done in a sub class derived from the Raytracer base class.
+ * Path traces the scene tile by tile on all threads, see renderTile(), or
+ * in wavefront mode with computeImageWavefront().
  */
 void PathTracer::computeImage()
 {
 	std::cout << "Raytracing..." << std::endl;
 	Timer timer;
+	resetRayStatistics();
 	
-	Color c;
-	int width = mImage->getWidth();
-	int height = mImage->getHeight();
-	
-	// Loop over all pixels in the image
-	/*for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			// Raytrace the pixel at (x,y).
-			
-			c = tracePixel(x,y);
-			// Store the result in the image.
-			mImage->setPixel(x,y,c);
-		}
-		
-		// Print progress approximately every 5%.
-		if ((y + 1) % (height / 20) == 0 || (y + 1) == height){
-			std::cout << (100 * (y + 1) / height) << "% done" << std::endl;
-		}
-	}*/
-
-	int lines = 0;
-	#pragma omp parallel for 
-		for (int y = 0; y < height; y++) {
-			for (int x = 0; x < width; x++) {
-				Color c = tracePixel(x, y);
-				mImage->setPixel(x, y, c);
-			}
-	#pragma omp critical 
-			{
-				lines++;
+	if (mWavefront){
+		computeImageWavefront();
+		std::cout << "Done in: " << timer.stop() << " seconds" << std::endl;
+		printRayStatistics(std::cout);
+		return;
+	}
 
-				if (lines % (height / 20) == 0 || lines == height)
-					std::cout << (100 * lines / height) << "%" << std::endl; 
-			}
-		}
+	renderTiles();
 
 	//std::cout << "Total number of rays: " << nbrRays << std::endl;
 	std::cout << "Done in: " << timer.stop() << " seconds" << std::endl;
+	printRayStatistics(std::cout);
+}
+
+/**
+ * Path traces the pixels of a tile by calling tracePixel() for each of
+ * them, and stores the results in the image.
+ */
+void PathTracer::renderTile(int x0, int y0, int x1, int y1)
+{
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			Color c = tracePixel(x, y);
+			mImage->setPixel(x, y, c);
+		}
+	}
 }
 
 /**
@@ -101,12 +94,24 @@ Color PathTracer::tracePixel(int x, int y)
 	Color pixelColor = Color(0.0f, 0.0f, 0.0f);
 
 	//super sampling, samples / pixel
-	for (int i = 0; i < iSamplesPerAxis; ++i){
-		for (int j = 0; j < iSamplesPerAxis; ++j){
-			float cx = (float)x + j / samplesPerAxis + uniform() / samplesPerAxis;
-			float cy = (float)y + i / samplesPerAxis + uniform() / samplesPerAxis;
-			Ray ray = mCamera->getRay(cx, cy);
-			pixelColor += trace(ray, 0);
+	// The camera rays are traced in packets, the paths continue one by one.
+	RayPacket packet;
+	PixelSample samples[RayPacket::maxSize];
+	Intersection is[RayPacket::maxSize];
+	int n = iSamplesPerAxis * iSamplesPerAxis;
+	for (int i = 0; i < n; ++i){
+		PixelSample& sample = samples[packet.size];
+		sample = PixelSample(mSampler, x, y, i);
+		float cx = (float)x + sample.next();
+		float cy = (float)y + sample.next();
+		packet.add(mCamera->getRay(cx, cy));
+		if (packet.size == RayPacket::maxSize || i == n - 1){
+			unsigned int hits = mScene->intersect(packet, is);
+			for (int k = 0; k < packet.size; ++k){
+				if (hits & (1u << k))
+					pixelColor += shade(is[k], 0, samples[k]);
+			}
+			packet.size = 0;
 		}
 	}
 	return pixelColor / nbrSamples;
@@ -115,75 +120,350 @@ Color PathTracer::tracePixel(int x, int y)
 /**
  * Computes the radiance returned by tracing the ray r.
  */
-Color PathTracer::trace(const Ray& ray, int depth)
+Color PathTracer::trace(const Ray& ray, int depth, PixelSample& sample)
 {
-	Color colorOut = Color(0.0f, 0.0f, 0.0f);//Color(1.0f,1.0f,1.0f);
 	Intersection is;
-	if (mScene->intersect(ray, is)){
-		Color reflectedC, refractedC, lDirect, lIndirect;
-		float type = uniform();
-		
-		float reflectivity = is.mMaterial->getReflectivity(is);
-		float transparency = is.mMaterial->getTransparency(is);
+	if (mScene->intersect(ray, is))
+		return shade(is, depth, sample);
+	//return lp.getRadiance(ray.dir);
+	return Color(0.0f, 0.0f, 0.0f);
+}
+
+/**
+ * Computes the radiance leaving the hit point is, reached at the given
+ * path depth. Each bounce draws four dimensions of the sample, so that
+ * a dimension has the same use in all paths.
+ */
+Color PathTracer::shade(const Intersection& is, int depth, PixelSample& sample)
+{
+	Color colorOut = Color(0.0f, 0.0f, 0.0f);
+	Color reflectedC, refractedC, lDirect, lIndirect;
+	float type = sample.next();
+	float survive = sample.next();
+	float u1 = sample.next();
+	float u2 = sample.next();
 	
-		if (type <= reflectivity){
-			colorOut = trace(is.getReflectedRay(), depth + 1);
+	float reflectivity = is.mMaterial->getReflectivity(is);
+	float transparency = is.mMaterial->getTransparency(is);
+	
+	if (type <= reflectivity){
+		colorOut = trace(is.getReflectedRay(), depth + 1, sample);
+	}
+	else if (type - reflectivity <= transparency){
+		colorOut = trace(is.getRefractedRay(), depth + 1, sample);
+	}
+	else{
+		
+		for (int i = 0; i < mScene->getNumberOfLights(); ++i){
+			PointLight* l = mScene->getLight(i);
+			if (!mScene->intersectShadow(is.getShadowRay(l), i)){
+				Vector3D lightVec = l->getWorldPosition() - is.mPosition;
+				float d2 = lightVec.length2();
+				lightVec.normalize();
+				Color radiance = l->getRadiance();
+				Color brdf = is.mMaterial->evalBRDF(is, lightVec);
+				float angle = max(lightVec * is.mNormal, 0.0f);
+				lDirect += radiance * brdf * angle / d2;
+			}
 		}
-		else if (type - reflectivity <= transparency){
-			colorOut = trace(is.getRefractedRay(), depth + 1);
+
+		if (depth < maxDepth || survive > p_abs){
+			float theta = acos(sqrt(1 - u1));
+			float phi = 2 * M_PI * u2;
+			float x = sin(theta) * cos(phi);
+			float y = sin(theta) * sin(phi);
+			float z = cos(theta);
+
+			Vector3D nvec(1.0f, 0.0f, 0.0f);
+			Vector3D mvec(0.0f, 1.0f, 0.0f);
+
+			Vector3D W = is.mNormal;
+			W.normalize();
+			Vector3D U = nvec % W;
+			if (U.length() < 0.01f)
+				U = mvec % W;
+			Vector3D V = W % U;
+
+			Vector3D dir = x * U + y * V + z * W;
+
+			Ray ray2;
+			ray2.orig = is.mPosition;
+			ray2.dir = dir;
+			ray2.updateTraversalData();
+			if (is.mMaterial->isEmissive()){
+				lDirect = is.mMaterial->evalBRDF(is, dir);
+			}
+			else{
+				lIndirect = M_PI * trace(ray2, depth + 1, sample)* is.mMaterial->evalBRDF(is, dir);
+			}
+			if (depth > maxDepth)
+				lIndirect *= abs_factor;
 		}
-		else{
-			
-			for (int i = 0; i < mScene->getNumberOfLights(); ++i){
-				PointLight* l = mScene->getLight(i);
-				if (!mScene->intersect(is.getShadowRay(l))){
-					Vector3D lightVec = l->getWorldPosition() - is.mPosition;
-					float d2 = lightVec.length2();
-					lightVec.normalize();
-					Color radiance = l->getRadiance();
-					Color brdf = is.mMaterial->evalBRDF(is, lightVec);
-					float angle = max(lightVec * is.mNormal, 0.0f);
-					lDirect += radiance * brdf * angle / d2;
+		colorOut = lDirect + lIndirect;
+	}
+	return colorOut;
+}
+
+/**
+ * Renders the image breadth-first. The pixels are processed in batches
+ * of about mWavefrontSize paths. All camera rays of a batch are generated
+ * first, and then each bounce runs as a sequence of kernels over all live
+ * paths: the rays are sorted for coherent traversal and intersected in
+ * packets, the hits are sorted by material and shaded, and the shadow
+ * rays they emit are traced in packets per light. Shading a hit adds the
+ * light reaching the path's start to the path's radiance, and either ends
+ * the path or continues it with a new ray. The result is the same
+ * estimator as trace(), only evaluated in a different order.
+ */
+void PathTracer::computeImageWavefront()
+{
+	int width = mImage->getWidth();
+	int height = mImage->getHeight();
+	int pixelsPerBatch = std::max(mWavefrontSize / iSamplesPerAxis / iSamplesPerAxis, 1);
+	int nLights = mScene->getNumberOfLights();
+
+	std::vector<PathState> paths, next, scratch;
+	std::vector<Intersection> hits;
+	std::vector<int> order;
+	std::vector<Color> radiance;
+	std::vector<Ray> shadowRays;
+	std::vector<Color> shadowWeights;
+	std::vector<unsigned char> shadowBlocked;
+
+	int done = 0;
+	for (int first = 0; first < width * height; first += pixelsPerBatch){
+		int count = std::min(pixelsPerBatch, width * height - first);
+
+		// Camera rays, iSamplesPerAxis^2 stratified samples per pixel.
+		paths.clear();
+		for (int p = 0; p < count; ++p){
+			int x = (first + p) % width;
+			int y = (first + p) / width;
+			for (int i = 0; i < iSamplesPerAxis; ++i){
+				for (int j = 0; j < iSamplesPerAxis; ++j){
+					// Each path draws from its own pixel sample, so the result
+					// does not depend on the order in which the kernels
+					// process the paths.
+					PathState s;
+					s.sample = PixelSample(mSampler, x, y, i * iSamplesPerAxis + j);
+					float cx = (float)x + s.sample.next();
+					float cy = (float)y + s.sample.next();
+					s.ray = mCamera->getRay(cx, cy);
+					s.throughput = Color(1.0f, 1.0f, 1.0f);
+					s.path = (int)paths.size();
+					s.depth = 0;
+					paths.push_back(s);
+				}
+			}
+		}
+		radiance.assign(paths.size(), Color(0.0f, 0.0f, 0.0f));
+
+		while (!paths.empty()){
+			int n = (int)paths.size();
+			sortPaths(paths, scratch);
+			hits.resize(n);
+			intersectPaths(paths, hits);
+
+			// Hit paths sorted by material, in ray order within a material.
+			order.clear();
+			for (int i = 0; i < n; ++i){
+				if (hits[i].mObject)
+					order.push_back(i);
+			}
+			std::stable_sort(order.begin(), order.end(), [&hits](int a, int b) { return hits[a].mMaterial < hits[b].mMaterial; });
+			int nHits = (int)order.size();
+
+			// Shade kernel. Each hit either continues its path into next,
+			// or sets up the shadow rays of its direct lighting, stored
+			// light by light so that the rays towards a light are adjacent.
+			next.resize(nHits);
+			shadowRays.resize((size_t)nHits * nLights);
+			shadowWeights.assign((size_t)nHits * nLights, Color(0.0f, 0.0f, 0.0f));
+			#pragma omp parallel for schedule(dynamic, 64)
+			for (int h = 0; h < nHits; ++h){
+				const PathState& s = paths[order[h]];
+				const Intersection& is = hits[order[h]];
+				PathState& out = next[h];
+				out.path = -1;
+				out.sample = s.sample;
+				float type = out.sample.next();
+				float survive = out.sample.next();
+				float u1 = out.sample.next();
+				float u2 = out.sample.next();
+				float reflectivity = is.mMaterial->getReflectivity(is);
+				float transparency = is.mMaterial->getTransparency(is);
+				if (type <= reflectivity || type - reflectivity <= transparency){
+					out.ray = type <= reflectivity ? is.getReflectedRay() : is.getRefractedRay();
+					out.throughput = s.throughput;
+					out.path = s.path;
+					out.depth = s.depth + 1;
+					continue;
+				}
+
+				bool emissive = false;
+				if (s.depth < maxDepth || survive > p_abs){
+					float theta = acos(sqrt(1 - u1));
+					float phi = 2 * M_PI * u2;
+					float x = sin(theta) * cos(phi);
+					float y = sin(theta) * sin(phi);
+					float z = cos(theta);
+
+					Vector3D nvec(1.0f, 0.0f, 0.0f);
+					Vector3D mvec(0.0f, 1.0f, 0.0f);
+
+					Vector3D W = is.mNormal;
+					W.normalize();
+					Vector3D U = nvec % W;
+					if (U.length() < 0.01f)
+						U = mvec % W;
+					Vector3D V = W % U;
+
+					Vector3D dir = x * U + y * V + z * W;
+
+					if (is.mMaterial->isEmissive()){
+						// Emitters replace the direct light, as in shade().
+						radiance[s.path] += s.throughput * is.mMaterial->evalBRDF(is, dir);
+						emissive = true;
+					}
+					else{
+						out.ray.orig = is.mPosition;
+						out.ray.dir = dir;
+						out.ray.minT = 0.001f;
+						out.ray.maxT = INF;
+						out.ray.primary = false;
+						out.ray.updateTraversalData();
+						out.throughput = s.throughput * (M_PI * is.mMaterial->evalBRDF(is, dir));
+						if (s.depth > maxDepth)
+							out.throughput *= abs_factor;
+						out.path = s.path;
+						out.depth = s.depth + 1;
+					}
+				}
+
+				if (!emissive){
+					for (int l = 0; l < nLights; ++l){
+						PointLight* light = mScene->getLight(l);
+						Vector3D lightVec = light->getWorldPosition() - is.mPosition;
+						float d2 = lightVec.length2();
+						lightVec.normalize();
+						Color brdf = is.mMaterial->evalBRDF(is, lightVec);
+						float angle = max(lightVec * is.mNormal, 0.0f);
+						shadowRays[(size_t)l * nHits + h] = is.getShadowRay(light);
+						shadowWeights[(size_t)l * nHits + h] = s.throughput * light->getRadiance() * brdf * angle / d2;
+					}
 				}
 			}
 
-			if (depth < maxDepth || uniform() > p_abs){
-				float theta = acos(sqrt(1 - uniform()));
-				float phi = 2 * M_PI * uniform();
-				float x = sin(theta) * cos(phi);
-				float y = sin(theta) * sin(phi);
-				float z = cos(theta);
-
-				Vector3D nvec(1.0f, 0.0f, 0.0f);
-				Vector3D mvec(0.0f, 1.0f, 0.0f);
-
-				Vector3D W = is.mNormal;
-				W.normalize();
-				Vector3D U = nvec % W;
-				if (U.length() < 0.01f)
-					U = mvec % W;
-				Vector3D V = W % U;
-
-				Vector3D dir = x * U + y * V + z * W;
-
-				Ray ray2;
-				ray2.orig = is.mPosition;
-				ray2.dir = dir;
-				if (is.mMaterial->isEmissive()){
-					lDirect = is.mMaterial->evalBRDF(is, dir);
+			// Shadow kernel, in packets of adjacent rays towards one light.
+			int nShadow = nHits * nLights;
+			shadowBlocked.assign(nShadow, 0);
+			int nPackets = (nShadow + RayPacket::maxSize - 1) / RayPacket::maxSize;
+			#pragma omp parallel for schedule(dynamic, 16)
+			for (int k = 0; k < nPackets; ++k){
+				int begin = k * RayPacket::maxSize;
+				int end = std::min(begin + RayPacket::maxSize, nShadow);
+				int light = begin / nHits;
+				RayPacket packet;
+				int index[RayPacket::maxSize];
+				for (int i = begin; i < end; ++i){
+					if (i / nHits != light){
+						// The packet reached the rays of the next light.
+						unsigned int blocked = mScene->intersectShadow(packet, light);
+						for (int j = 0; j < packet.size; ++j)
+							shadowBlocked[index[j]] = (blocked >> j) & 1;
+						packet.size = 0;
+						light = i / nHits;
+					}
+					if (shadowWeights[i].r > 0.0f || shadowWeights[i].g > 0.0f || shadowWeights[i].b > 0.0f){
+						index[packet.size] = i;
+						packet.add(shadowRays[i]);
+					}
 				}
-				else{
-					lIndirect = M_PI * trace(ray2, depth + 1)* is.mMaterial->evalBRDF(is, dir);
+				unsigned int blocked = mScene->intersectShadow(packet, light);
+				for (int j = 0; j < packet.size; ++j)
+					shadowBlocked[index[j]] = (blocked >> j) & 1;
+			}
+
+			// Gather the direct light of each hit into its path.
+			#pragma omp parallel for
+			for (int h = 0; h < nHits; ++h){
+				int path = paths[order[h]].path;
+				for (int l = 0; l < nLights; ++l){
+					size_t i = (size_t)l * nHits + h;
+					if (!shadowBlocked[i])
+						radiance[path] += shadowWeights[i];
 				}
-				if (depth > maxDepth)
-					lIndirect *= abs_factor;
 			}
-			colorOut = lDirect + lIndirect;
-		}			
+
+			// Compact the continued paths.
+			paths.clear();
+			for (int h = 0; h < nHits; ++h){
+				if (next[h].path >= 0)
+					paths.push_back(next[h]);
+			}
+		}
+
+		for (int p = 0; p < count; ++p){
+			Color c(0.0f, 0.0f, 0.0f);
+			for (int i = 0; i < iSamplesPerAxis * iSamplesPerAxis; ++i)
+				c += radiance[p * iSamplesPerAxis * iSamplesPerAxis + i];
+			mImage->setPixel((first + p) % width, (first + p) / width, c / nbrSamples);
+		}
+
+		// Print progress approximately every 5%.
+		int before = done;
+		done += count;
+		if (done * 20 / (width * height) != before * 20 / (width * height))
+			std::cout << (100LL * done / (width * height)) << "%" << std::endl;
 	}
-	else{
-		//colorOut = lp.getRadiance(ray.dir);
+}
+
+/**
+ * Sorts the paths by the octant of their ray direction, and by the Morton
+ * code of the ray origin within an octant. Rays that are next to each
+ * other then start in the same region and head the same way, so they
+ * visit mostly the same nodes and make coherent packets.
+ */
+void PathTracer::sortPaths(std::vector<PathState>& paths, std::vector<PathState>& scratch)
+{
+	AABB bounds;
+	for (size_t i = 0; i < paths.size(); ++i)
+		bounds.include(paths[i].ray.orig);
+
+	std::vector<int> index(paths.size());
+	std::vector<unsigned int> codes(paths.size());
+	for (size_t i = 0; i < paths.size(); ++i){
+		const Ray& ray = paths[i].ray;
+		unsigned int octant = ray.sign[0] | (ray.sign[1] << 1) | (ray.sign[2] << 2);
+		index[i] = (int)i;
+		codes[i] = (octant << 27) | (encodeMorton(ray.orig, bounds) >> 3);
 	}
-return colorOut;	
+	radixSortMorton(index, codes);
+
+	scratch.resize(paths.size());
+	for (size_t i = 0; i < paths.size(); ++i)
+		scratch[i] = paths[index[i]];
+	paths.swap(scratch);
 }
 
+/**
+ * Finds the closest hit of each path's ray, in packets of adjacent rays.
+ * Rays that miss get a hit with no object.
+ */
+void PathTracer::intersectPaths(const std::vector<PathState>& paths, std::vector<Intersection>& hits)
+{
+	int n = (int)paths.size();
+	int nPackets = (n + RayPacket::maxSize - 1) / RayPacket::maxSize;
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int k = 0; k < nPackets; ++k){
+		RayPacket packet;
+		int begin = k * RayPacket::maxSize;
+		for (int i = begin; i < std::min(begin + RayPacket::maxSize, n); ++i)
+			packet.add(paths[i].ray);
+		unsigned int hit = mScene->intersect(packet, &hits[begin]);
+		for (int j = 0; j < packet.size; ++j){
+			if (!(hit & (1u << j)))
+				hits[begin + j].mObject = 0;
+		}
+	}
+}
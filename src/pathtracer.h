@@ -11,6 +11,12 @@
 #define PATHTRACER_H
 
 #include "raytracer.h"
+#include "ray.h"
+#include "color.h"
+#include "sampler.h"
+#include <vector>
+
+class Intersection;
 
 /**
  * Class implementing a simple Whitted-style raytracer. 
@@ -28,10 +34,37 @@ public:
 	~PathTracer();
 
 	virtual void computeImage();
+
+	/**
+	 * Selects wavefront rendering. The paths of a batch of pixels are then
+	 * traced breadth-first, one bounce at a time for all of them, instead
+	 * of one path at a time, see computeImageWavefront().
+	 */
+	void setWavefront(bool enable) { mWavefront = enable; }
+
+	/// Sets the number of paths traced together in wavefront mode, the default is 65536.
+	void setWavefrontSize(int paths) { mWavefrontSize = paths; }
 	
 protected:
+	/// State of a path between the bounces of a wavefront.
+	struct PathState {
+		Ray ray;			///< Next ray of the path.
+		Color throughput;	///< Product of the path's weights up to the ray.
+		int path;			///< Index of the path in its batch.
+		int depth;
+		PixelSample sample;	///< Sample the path draws its random numbers from.
+	};
+
+	void renderTile(int x0, int y0, int x1, int y1);
 	Color tracePixel(int x, int y);
-	Color trace(const Ray& ray, int depth);
+	Color trace(const Ray& ray, int depth, PixelSample& sample);
+	Color shade(const Intersection& is, int depth, PixelSample& sample);
+	void computeImageWavefront();
+	void sortPaths(std::vector<PathState>& paths, std::vector<PathState>& scratch);
+	void intersectPaths(const std::vector<PathState>& paths, std::vector<Intersection>& hits);
+
+	bool mWavefront;		///< Trace breadth-first in batches of mWavefrontSize paths.
+	int mWavefrontSize;
 };
 
 #endif
@@ -15,13 +15,14 @@
 #include "material.h"
 #include "photonmapper.h"
 #include "timer.h"
+#include "raystats.h"
 #include "image.h"
 #include "lightprobe.h"
 #include "bvhhitpointaccelerator.h"
+#include "sampler.h"
 #include <omp.h>
 
 const float nbrSamples = 4.0;
-const float samplesPerAxis = 2.0;
 const int iSamplesPerAxis = 2;
 const bool sampling = true;
 const int maxDepth = 4;
@@ -56,6 +57,7 @@ void PhotonMapper::computeImage()
 {
 	std::cout << "Raytracing..." << std::endl;
 	Timer timer;
+	resetRayStatistics();
 	
 	Color c;
 	
@@ -88,27 +90,15 @@ void PhotonMapper::computeImage()
 
 	//std::cout << "Total number of rays: " << nbrRays << std::endl;
 	std::cout << "Done in: " << timer.stop() << " seconds" << std::endl;
+	printRayStatistics(std::cout);
 }
 
+/**
+ * Collects the hitpoints of the camera paths of all pixels, tile by tile
+ * on all threads, and builds the hitpoint BVH over them.
+ */
 void PhotonMapper::forwardPass(){
-	int width = mImage->getWidth();
-	int height = mImage->getHeight();
-
-	int lines = 0;
-//	#pragma omp parallel for 
-		for (int y = 0; y < height; y++) {
-			for (int x = 0; x < width; x++) {
-				forwardPassPixel(x, y);
-				//mImage->setPixel(x, y, c);
-			}
-//	#pragma omp critical 
-//			{
-				lines++;
-
-				//if (lines % (height / 20) == 0 || lines == height)
-				//	std::cout << (100 * lines / height) << "%" << std::endl;
-//			}
-		}
+	renderTiles();
 
 	cout << "Building BVH" << endl;
 	hitpointBVH.build(vec);
@@ -117,19 +107,34 @@ void PhotonMapper::forwardPass(){
 	//bvh.print();
 }
 
-void PhotonMapper::forwardPassPixel(int x, int y){
-	for (int i = 0; i < iSamplesPerAxis; ++i){
-		for (int j = 0; j < iSamplesPerAxis; ++j){
-			float cx = (float)x + j / samplesPerAxis + uniform() / samplesPerAxis;
-			float cy = (float)y + i / samplesPerAxis + uniform() / samplesPerAxis;
-			Ray ray = mCamera->getRay(cx, cy);
-			
-			forwardPassRay(ray, x, y, 1 / nbrSamples, 0);
+/**
+ * Forward pass over the pixels of a tile. The hitpoints are collected per
+ * tile, and appended to vec one tile at a time.
+ */
+void PhotonMapper::renderTile(int x0, int y0, int x1, int y1)
+{
+	std::vector<Hitpoint*> hitpoints;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			forwardPassPixel(x, y, hitpoints);
 		}
 	}
+	#pragma omp critical
+	vec.insert(vec.end(), hitpoints.begin(), hitpoints.end());
+}
+
+void PhotonMapper::forwardPassPixel(int x, int y, std::vector<Hitpoint*>& hitpoints){
+	for (int i = 0; i < iSamplesPerAxis * iSamplesPerAxis; ++i){
+		PixelSample sample(mSampler, x, y, i);
+		float cx = (float)x + sample.next();
+		float cy = (float)y + sample.next();
+		Ray ray = mCamera->getRay(cx, cy);
+		
+		forwardPassRay(ray, x, y, 1 / nbrSamples, 0, hitpoints);
+	}
 }
 
-void PhotonMapper::forwardPassRay(Ray ray, int x, int y, float weight, int depth){
+void PhotonMapper::forwardPassRay(Ray ray, int x, int y, float weight, int depth, std::vector<Hitpoint*>& hitpoints){
 	Intersection is;
 	if (weight > 0 && depth < maxForwardPassDepth && mScene->intersect(ray, is)){
 		Hitpoint* hp = new Hitpoint();
@@ -147,17 +152,17 @@ void PhotonMapper::forwardPassRay(Ray ray, int x, int y, float weight, int depth
 		hp->pixelWeight = (1.0f - reflectivity - transparency) * weight;
 		if (reflectivity > 0.0f) {
 			Ray reflectedRay = is.getReflectedRay();
-			forwardPassRay(reflectedRay, x, y, reflectivity * weight, depth+1);
+			forwardPassRay(reflectedRay, x, y, reflectivity * weight, depth+1, hitpoints);
 		}
 		if (transparency > 0.0f) {
 			Ray refractedRay = is.getRefractedRay();
-			forwardPassRay(refractedRay, x, y, transparency * weight, depth+1);
+			forwardPassRay(refractedRay, x, y, transparency * weight, depth+1, hitpoints);
 		}
 
 		if (diffuse){
 			for (int i = 0; i < mScene->getNumberOfLights(); ++i){
 				PointLight* l = mScene->getLight(i);
-				if (!mScene->intersect(is.getShadowRay(l))){
+				if (!mScene->intersectShadow(is.getShadowRay(l), i)){
 					Vector3D lightVec = l->getWorldPosition() - is.mPosition;
 					float d2 = lightVec.length2();
 					lightVec.normalize();
@@ -167,7 +172,7 @@ void PhotonMapper::forwardPassRay(Ray ray, int x, int y, float weight, int depth
 					hp->directIllumination += radiance * brdf * angle / d2;
 				}
 			}
-			vec.push_back(hp);
+			hitpoints.push_back(hp);
 		}
 	}
 }
@@ -177,19 +182,20 @@ void PhotonMapper::photonTracingPass(){
 		PointLight* l = mScene->getLight(i);
 		for (int i = 0; i < numberPhotons; ++i){
 			
-			Vector3D dir(uniform() * 2 - 1, uniform() * 2 - 1, uniform() * 2 - 1);
+			Vector3D dir(mRandom.uniform() * 2 - 1, mRandom.uniform() * 2 - 1, mRandom.uniform() * 2 - 1);
 			while(dir.length2() > 1.0f){
-				dir = Vector3D(uniform() * 2 - 1, uniform() * 2 - 1, uniform() * 2 - 1);
+				dir = Vector3D(mRandom.uniform() * 2 - 1, mRandom.uniform() * 2 - 1, mRandom.uniform() * 2 - 1);
 			}
 			dir.normalize();
 
 			Ray ray;
 			ray.orig = l->getWorldPosition();
 			ray.dir = dir;
+			ray.updateTraversalData();
 
 			Color startFlux = l->getRadiance() * 4.0f * M_PI;
 
-			trace(ray, 0, startFlux);
+			trace(ray, 0, startFlux, mRandom);
 		}
 	}
 }
@@ -198,7 +204,7 @@ void PhotonMapper::photonTracingPass(){
 /**
  * Computes the radiance returned by tracing the ray r.
  */
-void PhotonMapper::trace(const Ray& ray, int depth, const Color& flux)
+void PhotonMapper::trace(const Ray& ray, int depth, const Color& flux, Random& rng)
 {
 	Intersection is;
 	Color lIndirect = Color(0.0f, 0.0f, 0.0f);
@@ -209,24 +215,24 @@ void PhotonMapper::trace(const Ray& ray, int depth, const Color& flux)
 			Hitpoint hp;
 			hitpointBVH.intersect(is, flux);
 
-			float type = uniform();
+			float type = rng.uniform();
 
 			float reflectivity = is.mMaterial->getReflectivity(is);
 			float transparency = is.mMaterial->getTransparency(is);
 
 			if (type <= reflectivity){
-				trace(is.getReflectedRay(), depth + 1, flux);
+				trace(is.getReflectedRay(), depth + 1, flux, rng);
 				return;
 			}
 			else if (type - reflectivity <= transparency){
-				trace(is.getRefractedRay(), depth + 1, flux);
+				trace(is.getRefractedRay(), depth + 1, flux, rng);
 				return;
 			}
 		}
 
-		if (depth < maxDepth || uniform() > p_abs){
-			float theta = acos(sqrt(1 - uniform()));
-			float phi = 2 * M_PI * uniform();
+		if (depth < maxDepth || rng.uniform() > p_abs){
+			float theta = acos(sqrt(1 - rng.uniform()));
+			float phi = 2 * M_PI * rng.uniform();
 			float x = sin(theta) * cos(phi);
 			float y = sin(theta) * sin(phi);
 			float z = cos(theta);
@@ -246,12 +252,13 @@ void PhotonMapper::trace(const Ray& ray, int depth, const Color& flux)
 			Ray ray2;
 			ray2.orig = is.mPosition;
 			ray2.dir = dir;
+			ray2.updateTraversalData();
 			Color addFlux = M_PI * is.mMaterial->evalBRDF(is, ray.dir) * flux * (is.mNormal * dir);
 			
 			if (depth >= maxDepth)
 				addFlux *= abs_factor;
 
-			trace(ray2, depth + 1, addFlux);
+			trace(ray2, depth + 1, addFlux, rng);
 		}
 	}
 }
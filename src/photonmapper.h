@@ -12,6 +12,7 @@
 
 #include "raytracer.h"
 #include "bvhhitpointaccelerator.h"
+#include "random.h"
 
 /**
  * Class implementing a simple Whitted-style raytracer. 
@@ -31,13 +32,15 @@ public:
 	virtual void computeImage();
 protected:
 	void forwardPass();
-	void forwardPassPixel(int x, int y);
-	void forwardPassRay(Ray ray, int x, int y, float weight, int depth);
+	void renderTile(int x0, int y0, int x1, int y1);
+	void forwardPassPixel(int x, int y, std::vector<Hitpoint*>& hitpoints);
+	void forwardPassRay(Ray ray, int x, int y, float weight, int depth, std::vector<Hitpoint*>& hitpoints);
 	void photonTracingPass();
-	void trace(const Ray& ray, int depth, const Color& flux);
+	void trace(const Ray& ray, int depth, const Color& flux, Random& rng);
 	void output(int i);
 	std::vector<Hitpoint*> vec;
 	BVHHitpointAccelerator hitpointBVH;
+	Random mRandom;		///< Random numbers of the photon tracing passes.
 };
 
 #endif
@@ -0,0 +1,67 @@
+/*
+*  random.h
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+/**
+ * Small and fast pseudo-random number generator, PCG32 by M. O'Neill.
+ * The state is 16 bytes, so each thread, pixel or path can own one. A
+ * generator seeded with the same value always returns the same sequence,
+ * which makes renders reproducible however the work is split between
+ * threads. Not safe to share between threads.
+ */
+class Random
+{
+public:
+	/**
+	 * Creates a generator seeded with seed. Different seeds give
+	 * uncorrelated sequences, also for consecutive seeds such as pixel
+	 * indices.
+	 */
+	explicit Random(unsigned long long seed = 0) { setSeed(seed); }
+
+	/// Restarts the generator with a new seed.
+	void setSeed(unsigned long long seed)
+	{
+		// Both the start state and the stream come from the seed, mixed
+		// with SplitMix64 so that nearby seeds end up far apart.
+		unsigned long long stream = mix(seed + 0x9E3779B97F4A7C15ull);
+		mState = 0;
+		mInc = (stream << 1) | 1;
+		next();
+		mState += mix(seed);
+		next();
+	}
+
+	/// Returns a uniform random 32-bit integer.
+	unsigned int next()
+	{
+		unsigned long long old = mState;
+		mState = old * 6364136223846793005ull + mInc;
+		unsigned int xorshifted = (unsigned int)(((old >> 18) ^ old) >> 27);
+		unsigned int rot = (unsigned int)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+	}
+
+	/// Returns a uniform random number in the range [0,1).
+	float uniform() { return (float)(next() >> 8) * (1.0f / 16777216.0f); }
+
+private:
+	static unsigned long long mix(unsigned long long z)
+	{
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	unsigned long long mState;	///< Current state.
+	unsigned long long mInc;	///< Stream selector, always odd.
+};
+
+#endif
@@ -39,24 +39,39 @@ public:
 	float maxT;			///< End time of ray.
 	Differential dp;	///< Origin ray differential.
 	Differential dd;	///< Direction ray differential.
+	Vector3D invDir;	///< Inverse of the direction, per component.
+	int sign[3];		///< 1 if the direction is negative along the axis, 0 otherwise.
+	bool primary;		///< True for camera rays, used by the traversal statistics.
 	
 public:
 	/// Default Constructor. The position and direction are left
 	/// un-initialized, but the time is set to 0 and infinity respectively.
-	Ray() : minT(0.001f), maxT(INF) { }
+	/// Call updateTraversalData() after setting the direction.
+	Ray() : minT(0.001f), maxT(INF), primary(false) { }
 	
 	Ray(const Point3D& o, const Vector3D& d, float mint=0.001f, float maxt=INF)
-	: orig(o), dir(d), minT(mint), maxT(maxt)
+	: orig(o), dir(d), minT(mint), maxT(maxt), primary(false)
 	{
 		dir.normalize();
+		updateTraversalData();
 	}
 	
 	/// Constructor initializing the ray's origin and direction,
 	/// and optionally the time parameters. The direction is normalized.
 	Ray(const Point3D& o, const Vector3D& d, const Differential& dp = Differential(), const Differential& dd = Differential(), float mint=0.001f, float maxt=INF)
-		: orig(o), dir(d), dp(dp), dd(dd), minT(mint), maxT(maxt)
+		: orig(o), dir(d), dp(dp), dd(dd), minT(mint), maxT(maxt), primary(false)
 	{
 		dir.normalize();
+		updateTraversalData();
+	}
+	
+	/// Recomputes the cached inverse direction and signs from dir.
+	void updateTraversalData()
+	{
+		invDir = Vector3D(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+		sign[0] = invDir.x < 0.0f;
+		sign[1] = invDir.y < 0.0f;
+		sign[2] = invDir.z < 0.0f;
 	}
 	
 	/// Destructor.
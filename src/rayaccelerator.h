@@ -11,14 +11,64 @@
 #define RAYACCELERATOR_H
 
 #include "intersectable.h"
+#include "raypacket.h"
 #include <vector>
 
 class RayAccelerator
 {
 public:
 	virtual void build(const std::vector<Intersectable*>& objects) = 0;
+
+	/**
+	 * Updates the structure after the objects of the last build have moved.
+	 * The objects must be the same as in the last call to build(). The
+	 * default implementation rebuilds the structure.
+	 */
+	virtual void refit(const std::vector<Intersectable*>& objects) { build(objects); }
+
 	virtual bool intersect(const Ray& ray) = 0;
+
+	/**
+	 * Returns a primitive that blocks the ray, or 0 if there is none. Same
+	 * test as intersect(const Ray&), but the occluder is returned so that
+	 * shadow rays can try it first for the next ray towards the same light.
+	 */
+	virtual Intersectable* findOccluder(const Ray& ray) = 0;
+
 	virtual bool intersect(const Ray& ray, Intersection& is) = 0;
+
+	/**
+	 * Finds the closest hit of each ray in the packet, returned in is[i]
+	 * for rays[i]. Returns a bit mask of the rays that hit anything. The
+	 * default implementation traces the rays one at a time.
+	 */
+	virtual unsigned int intersect(const RayPacket& packet, Intersection* is)
+	{
+		unsigned int hits = 0;
+		for (int i = 0; i < packet.size; ++i){
+			if (intersect(packet.rays[i], is[i]))
+				hits |= 1u << i;
+		}
+		return hits;
+	}
+
+	/**
+	 * Finds a primitive that blocks each ray in the packet, returned in
+	 * occluders[i] for rays[i], or 0 if there is none. Returns a bit mask
+	 * of the blocked rays. The default implementation traces the rays one
+	 * at a time.
+	 */
+	virtual unsigned int findOccluders(const RayPacket& packet, Intersectable** occluders)
+	{
+		unsigned int blocked = 0;
+		for (int i = 0; i < packet.size; ++i){
+			occluders[i] = findOccluder(packet.rays[i]);
+			if (occluders[i])
+				blocked |= 1u << i;
+		}
+		return blocked;
+	}
+
 	virtual ~RayAccelerator() {}
 };
 
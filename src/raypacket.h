@@ -0,0 +1,129 @@
+/*
+*  raypacket.h
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include "ray.h"
+#include <algorithm>
+#include <cmath>
+
+/**
+ * A group of up to 16 rays traced together, e.g. the 4x4 camera rays of
+ * a pixel or the shadow rays from their hits towards one light. Results
+ * are returned as bit masks with bit i set for rays[i]. Accelerators may
+ * trace coherent packets together and share work between the rays, see
+ * isCoherent(), but all rays get the same hits as when traced alone.
+ */
+struct RayPacket {
+	static const int maxSize = 16;
+
+	Ray rays[maxSize];
+	int size;
+
+	RayPacket() : size(0) { }
+
+	/// Appends a ray, the packet must not be full.
+	void add(const Ray& ray) { rays[size++] = ray; }
+
+	/// Returns a mask with the bits of all rays in the packet set.
+	unsigned int all() const { return (1u << size) - 1; }
+
+	/**
+	 * Returns true if all rays have the same direction signs and no zero
+	 * direction components. Such packets visit the children of each node
+	 * in the same order, and their slabs can be bounded by intervals.
+	 */
+	bool isCoherent() const
+	{
+		if (size == 0)
+			return false;
+		for (int i = 0; i < size; ++i){
+			for (int k = 0; k < 3; ++k){
+				if (rays[i].sign[k] != rays[0].sign[k] || !(std::fabs(rays[i].invDir(k)) < INF))
+					return false;
+			}
+		}
+		return true;
+	}
+};
+
+/**
+ * Conservative bounds of the origins, inverse directions and ray
+ * intervals of a packet. If a box is missed by the interval version of
+ * the slab test, it is missed by every ray in the packet.
+ */
+struct RayPacketBounds {
+	float orig[2][3];		///< Minimum and maximum origin.
+	float invDir[2][3];		///< Minimum and maximum inverse direction.
+	float minT;				///< Smallest ray start.
+	float maxT;				///< Largest ray end, updated by the traversal as rays get shorter.
+
+	explicit RayPacketBounds(const RayPacket& packet)
+	{
+		for (int k = 0; k < 3; ++k){
+			orig[0][k] = orig[1][k] = packet.rays[0].orig(k);
+			invDir[0][k] = invDir[1][k] = packet.rays[0].invDir(k);
+		}
+		minT = packet.rays[0].minT;
+		maxT = packet.rays[0].maxT;
+		for (int i = 1; i < packet.size; ++i){
+			const Ray& ray = packet.rays[i];
+			for (int k = 0; k < 3; ++k){
+				orig[0][k] = std::min(orig[0][k], ray.orig(k));
+				orig[1][k] = std::max(orig[1][k], ray.orig(k));
+				invDir[0][k] = std::min(invDir[0][k], ray.invDir(k));
+				invDir[1][k] = std::max(invDir[1][k], ray.invDir(k));
+			}
+			minT = std::min(minT, ray.minT);
+			maxT = std::max(maxT, ray.maxT);
+		}
+	}
+
+	/**
+	 * Interval slab test of a box stored as bmin followed by bmax. Returns
+	 * false only if no ray of the packet can hit the box.
+	 */
+	bool mayHit(const float* b) const
+	{
+		float t0 = minT;
+		float t1 = maxT;
+		for (int k = 0; k < 3; ++k){
+			float lo, hi;
+			// Range of (b[k] - o) * invDir over the packet for each plane,
+			// from the four products of the interval ends.
+			for (int side = 0; side < 2; ++side){
+				float d0 = b[side * 3 + k] - orig[1][k];
+				float d1 = b[side * 3 + k] - orig[0][k];
+				float p0 = d0 * invDir[0][k], p1 = d0 * invDir[1][k];
+				float p2 = d1 * invDir[0][k], p3 = d1 * invDir[1][k];
+				float pMin = std::min(std::min(p0, p1), std::min(p2, p3));
+				float pMax = std::max(std::max(p0, p1), std::max(p2, p3));
+				if (side == 0){
+					lo = pMin;
+					hi = pMax;
+				}
+				else{
+					// The near plane is bmin for positive directions and
+					// bmax for negative ones, all rays share the sign.
+					if (invDir[0][k] >= 0.0f){
+						t0 = std::max(t0, lo);
+						t1 = std::min(t1, pMax);
+					}
+					else{
+						t0 = std::max(t0, pMin);
+						t1 = std::min(t1, hi);
+					}
+				}
+			}
+		}
+		return t0 <= t1;
+	}
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ *  raystats.cpp
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#include "defines.h"
+#include "raystats.h"
+
+#ifdef COLLECT_RAY_STATISTICS
+
+#include <cstring>
+#include <iomanip>
+
+/// Number of per-thread counter slots. Threads beyond this share slots.
+static const int maxThreads = 64;
+
+/// Counters of one thread, padded so that no two threads share a cache line.
+struct ThreadCounters {
+	RayCounters counters[RAY_CATEGORIES];
+	char pad[64];
+};
+
+static ThreadCounters threadCounters[maxThreads];
+static int threadCount = 0;
+static THREAD_LOCAL int threadSlot = -1;
+
+/**
+ * Adds the counters of one ray to the calling thread's totals.
+ */
+void addRayCounters(RayCategory category, const RayCounters& counters)
+{
+	if (threadSlot < 0) {
+		#pragma omp critical(raystats)
+		threadSlot = threadCount++ % maxThreads;
+	}
+	RayCounters& c = threadCounters[threadSlot].counters[category];
+	c.rays += counters.rays;
+	c.nodeVisits += counters.nodeVisits;
+	c.boxTests += counters.boxTests;
+	c.primitiveTests += counters.primitiveTests;
+}
+
+/**
+ * Clears the counters of all threads. Must not be called while rendering.
+ */
+void resetRayStatistics()
+{
+	std::memset(threadCounters, 0, sizeof(threadCounters));
+}
+
+/**
+ * Prints the totals of all threads, and the average work per ray
+ * for each ray category.
+ */
+void printRayStatistics(std::ostream& out)
+{
+	static const char* names[RAY_CATEGORIES] = { "primary", "secondary", "shadow" };
+
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+
+	out << "Ray statistics:" << std::endl;
+	for (int k = 0; k < RAY_CATEGORIES; ++k) {
+		RayCounters total = { 0, 0, 0, 0 };
+		for (int t = 0; t < maxThreads; ++t) {
+			const RayCounters& c = threadCounters[t].counters[k];
+			total.rays += c.rays;
+			total.nodeVisits += c.nodeVisits;
+			total.boxTests += c.boxTests;
+			total.primitiveTests += c.primitiveTests;
+		}
+
+		double rays = total.rays ? (double)total.rays : 1.0;
+		out << "  " << std::setw(9) << std::left << names[k] << std::right
+			<< std::setw(12) << total.rays << " rays, per ray: "
+			<< std::fixed << std::setprecision(2)
+			<< total.nodeVisits / rays << " nodes, "
+			<< total.boxTests / rays << " boxes, "
+			<< total.primitiveTests / rays << " primitives" << std::endl;
+	}
+	out.flags(flags);
+	out.precision(precision);
+}
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ *  raystats.h
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#ifndef RAYSTATS_H
+#define RAYSTATS_H
+
+#include <iosfwd>
+#include "ray.h"
+
+/**
+ * Ray traversal statistics, enabled by defining COLLECT_RAY_STATISTICS.
+ * The accelerators count the node visits, box tests and primitive tests of
+ * each ray in a TraversalStats object on the stack, which adds them to the
+ * counters of the calling thread when it goes out of scope. Each thread has
+ * its own cache line of counters, so the renderers' threads never write to
+ * shared memory while tracing. Any-hit queries are counted as shadow rays,
+ * closest-hit queries as primary (camera) or secondary rays.
+ * Without the define, TraversalStats is empty and compiles to nothing.
+ */
+enum RayCategory {
+	RAY_PRIMARY,
+	RAY_SECONDARY,
+	RAY_SHADOW,
+	RAY_CATEGORIES
+};
+
+/// Traversal counters of one ray category.
+struct RayCounters {
+	unsigned long long rays;
+	unsigned long long nodeVisits;
+	unsigned long long boxTests;
+	unsigned long long primitiveTests;
+};
+
+#ifdef COLLECT_RAY_STATISTICS
+
+void addRayCounters(RayCategory category, const RayCounters& counters);
+void resetRayStatistics();
+void printRayStatistics(std::ostream& out);
+
+/// Counts the work of tracing one ray.
+class TraversalStats
+{
+public:
+	TraversalStats(const Ray& ray, bool anyHit)
+		: category(anyHit ? RAY_SHADOW : (ray.primary ? RAY_PRIMARY : RAY_SECONDARY))
+	{
+		counters.rays = 1;
+		counters.nodeVisits = counters.boxTests = counters.primitiveTests = 0;
+	}
+	~TraversalStats() { addRayCounters(category, counters); }
+
+	void visitNode() { ++counters.nodeVisits; }
+	void testBoxes(int n) { counters.boxTests += n; }
+	void testPrimitive() { ++counters.primitiveTests; }
+	void testPrimitives(int n) { counters.primitiveTests += n; }
+	void setRays(int n) { counters.rays = n; }	///< For packets, which count all their rays in one object.
+
+private:
+	RayCategory category;
+	RayCounters counters;
+};
+
+#else
+
+inline void resetRayStatistics() { }
+inline void printRayStatistics(std::ostream&) { }
+
+class TraversalStats
+{
+public:
+	TraversalStats(const Ray&, bool) { }
+	void visitNode() { }
+	void testBoxes(int) { }
+	void testPrimitive() { }
+	void testPrimitives(int) { }
+	void setRays(int) { }
+};
+
+#endif
+
+#endif
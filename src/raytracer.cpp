@@ -16,13 +16,141 @@
 #include "material.h"
 #include "timer.h"
 #include "raytracer.h"
+#include "sampler.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+/// Sampler used by raytracers without one of their own.
+const SobolSampler defaultSampler;
+
+/// Spreads the lower 16 bits of v so that there is a zero bit between each bit.
+unsigned int expandBits2D(unsigned int v)
+{
+	v &= 0x0000FFFFu;
+	v = (v | (v << 8)) & 0x00FF00FFu;
+	v = (v | (v << 4)) & 0x0F0F0F0Fu;
+	v = (v | (v << 2)) & 0x33333333u;
+	v = (v | (v << 1)) & 0x55555555u;
+	return v;
+}
+
+/**
+ * Returns the distance from the start of a Hilbert curve through an n x n
+ * grid to the cell (x,y), n must be a power of two.
+ */
+unsigned int hilbertIndex(unsigned int n, unsigned int x, unsigned int y)
+{
+	unsigned int d = 0;
+	for (unsigned int s = n / 2; s > 0; s /= 2){
+		unsigned int rx = (x & s) ? 1 : 0;
+		unsigned int ry = (y & s) ? 1 : 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant so that the curve in it starts in its corner.
+		if (ry == 0){
+			if (rx == 1){
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+/**
+ * The tiles owned by one thread, a range [begin,end) in the tile order.
+ * Both ends are packed into one word and updated with compare-and-swap,
+ * the owner takes tiles from the front and other threads steal from the
+ * back. Padded to a cache line, since all threads poll the queues.
+ */
+struct TileQueue {
+	std::atomic<unsigned long long> range;
+	char pad[64 - sizeof(std::atomic<unsigned long long>)];
+
+	void init(unsigned int begin, unsigned int end)
+	{
+		range.store(((unsigned long long)begin << 32) | end);
+	}
+
+	/// Returns the number of tiles left, may be out of date at once.
+	unsigned int size() const
+	{
+		unsigned long long r = range.load();
+		unsigned int begin = (unsigned int)(r >> 32), end = (unsigned int)r;
+		return begin < end ? end - begin : 0;
+	}
+
+	/// Takes the first tile, returns false if the queue is empty.
+	bool popFront(unsigned int& tile)
+	{
+		unsigned long long r = range.load();
+		for (;;){
+			unsigned int begin = (unsigned int)(r >> 32), end = (unsigned int)r;
+			if (begin >= end)
+				return false;
+			if (range.compare_exchange_weak(r, ((unsigned long long)(begin + 1) << 32) | end)){
+				tile = begin;
+				return true;
+			}
+		}
+	}
+
+	/// Takes the last tile, returns false if the queue is empty.
+	bool popBack(unsigned int& tile)
+	{
+		unsigned long long r = range.load();
+		for (;;){
+			unsigned int begin = (unsigned int)(r >> 32), end = (unsigned int)r;
+			if (begin >= end)
+				return false;
+			if (range.compare_exchange_weak(r, ((unsigned long long)begin << 32) | (end - 1))){
+				tile = end - 1;
+				return true;
+			}
+		}
+	}
+};
+
+/**
+ * Steals a tile for thread t from the back of the fullest other queue.
+ * Returns false when all queues are empty.
+ */
+bool stealTile(std::vector<TileQueue>& queues, int t, unsigned int& tile)
+{
+	int n = (int)queues.size();
+	for (;;){
+		int victim = -1;
+		unsigned int most = 0;
+		for (int i = 1; i < n; ++i){
+			int q = (t + i) % n;
+			unsigned int size = queues[q].size();
+			if (size > most){
+				most = size;
+				victim = q;
+			}
+		}
+		if (victim < 0)
+			return false;
+		if (queues[victim].popBack(tile))
+			return true;
+	}
+}
+
+}
 
 /**
  * Creates a raytracer.
  * @param scene Point3Der to the scene.
  * @param img Point3Der to an Image object where the output will be stored.
  */
-Raytracer::Raytracer(Scene* scene, Image* img) : mScene(scene), mImage(img), mCamera(0)
+Raytracer::Raytracer(Scene* scene, Image* img) : mScene(scene), mImage(img), mCamera(0),
+	mTileSize(16), mTileOrder(HILBERT_ORDER), mSampler(&defaultSampler)
 {
 	if (!mScene || !mImage)
 		throw std::runtime_error("(Raytracer::Raytracer) null pointer");
@@ -33,3 +161,89 @@ Raytracer::Raytracer(Scene* scene, Image* img) : mScene(scene), mImage(img), mCa
 	mCamera = mScene->getCamera(0); // Use the first camera.
 }
 
+/**
+ * Sets the width and height of the tiles in pixels. Smaller tiles balance
+ * the load better, larger ones keep the rays of each thread coherent.
+ */
+void Raytracer::setTileSize(int size)
+{
+	if (size < 1)
+		throw std::runtime_error("(Raytracer::setTileSize) tile size must be positive");
+	mTileSize = size;
+}
+
+/**
+ * Sets the sampler the pixel samples are drawn from.
+ */
+void Raytracer::setSampler(const Sampler* sampler)
+{
+	if (!sampler)
+		throw std::runtime_error("(Raytracer::setSampler) null pointer");
+	mSampler = sampler;
+}
+
+/**
+ * Renders the image by calling renderTile() for each tile on all threads.
+ * The tiles are sorted in mTileOrder, and each thread starts with its own
+ * contiguous part of the order, i.e. a compact region of the image. When
+ * a thread runs out of tiles, it steals from the end of the part with the
+ * most tiles left, so threads that got cheap tiles help with the costly
+ * ones. Progress is printed approximately every 5%.
+ */
+void Raytracer::renderTiles()
+{
+	int width = mImage->getWidth();
+	int height = mImage->getHeight();
+	int tilesX = (width + mTileSize - 1) / mTileSize;
+	int tilesY = (height + mTileSize - 1) / mTileSize;
+	int nTiles = tilesX * tilesY;
+	if (nTiles == 0)
+		return;
+
+	// Sort the tiles along the curve, scanline order is the tile index.
+	unsigned int n = 1;
+	while (n < (unsigned int)std::max(tilesX, tilesY))
+		n *= 2;
+	std::vector<std::pair<unsigned int, int> > keys(nTiles);
+	for (int i = 0; i < nTiles; ++i){
+		unsigned int tx = i % tilesX, ty = i / tilesX;
+		unsigned int key = i;
+		if (mTileOrder == MORTON_ORDER)
+			key = expandBits2D(tx) | (expandBits2D(ty) << 1);
+		else if (mTileOrder == HILBERT_ORDER)
+			key = hilbertIndex(n, tx, ty);
+		keys[i] = std::make_pair(key, i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	int nThreads = 1;
+#ifdef _OPENMP
+	nThreads = std::min(omp_get_max_threads(), nTiles);
+#endif
+	std::vector<TileQueue> queues(nThreads);
+	for (int t = 0; t < nThreads; ++t)
+		queues[t].init((unsigned int)((long long)t * nTiles / nThreads), (unsigned int)((long long)(t + 1) * nTiles / nThreads));
+
+	std::atomic<int> tilesDone(0);
+
+	#pragma omp parallel num_threads(nThreads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		unsigned int next;
+		while (queues[t].popFront(next) || stealTile(queues, t, next)){
+			int tile = keys[next].second;
+			int x0 = (tile % tilesX) * mTileSize;
+			int y0 = (tile / tilesX) * mTileSize;
+			renderTile(x0, y0, std::min(x0 + mTileSize, width), std::min(y0 + mTileSize, height));
+
+			int done = ++tilesDone;
+			if (done * 20 / nTiles != (done - 1) * 20 / nTiles){
+				#pragma omp critical
+				std::cout << (100 * done / nTiles) << "% done" << std::endl;
+			}
+		}
+	}
+}
@@ -14,28 +14,58 @@ class Scene;
 class Image;
 class Camera;
 class Color;
+class Sampler;
 
 /**
  * Base class for raytracers, containinng basic functionality needed 
  * for implementing various raytracing algorithms (Whitted, Pathtracing).
- * When the function computeImage() is called, the image is raytraced by 
- * calling tracePixel() for each pixel in the output image. A very basic
- * implementation of tracePixel is provided, but to implement more advanced
- * algorithms (Whitted, Pathtracing), the tracePixel() function should be
- * overridden in a sub class.
+ * The image is split into square tiles, which renderTiles() hands out to
+ * all threads. Sub classes implement renderTile(), which renders the
+ * pixels of one tile, and call renderTiles() from computeImage().
  */
 class Raytracer
 {
 public:
+	/// Orders in which the tiles are rendered.
+	enum TileOrder {
+		SCANLINE_ORDER,		///< Row by row.
+		MORTON_ORDER,		///< Along a Morton (Z-order) curve.
+		HILBERT_ORDER		///< Along a Hilbert curve, the default.
+	};
+
 	Raytracer(Scene* scene, Image* img);
 	virtual ~Raytracer() {}
 
 	virtual void computeImage() = 0;
 
+	/// Sets the width and height of the tiles in pixels, the default is 16.
+	void setTileSize(int size);
+
+	/// Sets the order in which the tiles are rendered.
+	void setTileOrder(TileOrder order) { mTileOrder = order; }
+
+	/**
+	 * Sets the sampler the pixel samples are drawn from. The sampler is not
+	 * owned by the raytracer. The default is an Owen-scrambled Sobol sampler.
+	 */
+	void setSampler(const Sampler* sampler);
+
+protected:
+	void renderTiles();
+
+	/**
+	 * Renders the pixels x0 <= x < x1, y0 <= y < y1 of the image. Called
+	 * from several threads at once, each with its own tile.
+	 */
+	virtual void renderTile(int x0, int y0, int x1, int y1) = 0;
+
 protected:
 	Scene* mScene;		///< Ptr to the scene.
 	Image* mImage;		///< Ptr to the output image.
 	Camera* mCamera;	///< Ptr to the camera used for rendering.
+	int mTileSize;		///< Width and height of the tiles in pixels.
+	TileOrder mTileOrder;
+	const Sampler* mSampler;	///< Source of the pixel samples.
 };
 
 #endif
@@ -0,0 +1,348 @@
+/*
+*  sampler.cpp
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#include "defines.h"
+#include "sampler.h"
+#include "random.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+/// Largest float below one.
+const float oneMinusEpsilon = 0.99999994f;
+
+/// Number of primes in the Halton base table.
+const int numPrimes = 64;
+
+/// The first primes, bases of the Halton dimensions.
+const unsigned int primes[numPrimes] = {
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+	59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+	137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+	227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+
+/// Integer hash with good avalanche, by C. Wellons.
+unsigned int hashBits(unsigned int x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+/// Hashes a seed together with a value.
+unsigned int hashCombine(unsigned int seed, unsigned int v)
+{
+	return hashBits(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+/// Returns the seed of the pixel (x,y).
+unsigned int pixelSeed(int x, int y)
+{
+	return hashCombine(hashBits((unsigned int)x), (unsigned int)y);
+}
+
+/// Maps 32 random bits to a float in [0,1).
+float toFloat(unsigned int v)
+{
+	return (float)(v >> 8) * (1.0f / 16777216.0f);
+}
+
+/**
+ * Returns element i of a random permutation of 0..l-1 selected by p,
+ * without storing it. From Kensler, "Correlated Multi-Jittered Sampling",
+ * 2013.
+ */
+unsigned int permute(unsigned int i, unsigned int l, unsigned int p)
+{
+	unsigned int w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	// Permute within the next power of two, and repeat until inside 0..l-1.
+	do {
+		i ^= p; i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8; i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1; i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11; i *= 0x74dcb303u;
+		i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+	return (i + p) % l;
+}
+
+unsigned int reverseBits(unsigned int x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+/**
+ * Nested uniform (Owen) scrambling of the bits of x, most significant bit
+ * first. Each bit is flipped depending on a hash of the bits above it.
+ * Uses the Laine-Karras permutation on the reversed bits, as in Burley.
+ */
+unsigned int nestedUniformScramble(unsigned int x, unsigned int seed)
+{
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+}
+
+/**
+ * Returns a hash of the pixel, index and dimension.
+ */
+float IndependentSampler::get(int x, int y, int index, int dim) const
+{
+	return toFloat(hashCombine(hashCombine(pixelSeed(x, y), (unsigned int)index), (unsigned int)dim));
+}
+
+/**
+ * Creates a stratified sampler for samplesPerPixel samples per pixel.
+ * Further samples start over with new strata orders.
+ */
+StratifiedSampler::StratifiedSampler(int samplesPerPixel)
+{
+	if (samplesPerPixel < 1)
+		throw std::runtime_error("(StratifiedSampler::StratifiedSampler) samples per pixel must be positive");
+	mStrataX = std::max((int)std::sqrt((float)samplesPerPixel), 1);
+	mStrataY = (samplesPerPixel + mStrataX - 1) / mStrataX;
+}
+
+/**
+ * Returns the jittered position in the sample's stratum of the pair that
+ * dim belongs to.
+ */
+float StratifiedSampler::get(int x, int y, int index, int dim) const
+{
+	unsigned int strata = (unsigned int)(mStrataX * mStrataY);
+	unsigned int seed = hashCombine(pixelSeed(x, y), (unsigned int)dim / 2);
+	unsigned int stratum = permute((unsigned int)index % strata, strata, hashCombine(seed, (unsigned int)index / strata));
+	float jitter = toFloat(hashCombine(hashCombine(seed, (unsigned int)index), (unsigned int)dim));
+	float v;
+	if (dim % 2 == 0)
+		v = ((float)(stratum % mStrataX) + jitter) / (float)mStrataX;
+	else
+		v = ((float)(stratum / mStrataX) + jitter) / (float)mStrataY;
+	return std::min(v, oneMinusEpsilon);
+}
+
+/**
+ * Creates a Sobol sampler. The generator matrices are computed from the
+ * primitive polynomials and direction numbers of Joe and Kuo.
+ */
+SobolSampler::SobolSampler()
+{
+	// Degree, polynomial coefficients and initial direction numbers of
+	// Sobol dimensions 2-4, the first is the van der Corput sequence.
+	static const unsigned int degree[3] = { 1, 2, 3 };
+	static const unsigned int poly[3] = { 0, 1, 1 };
+	static const unsigned int initial[3][3] = { { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+	for (int k = 0; k < 32; ++k)
+		mMatrices[0][k] = 1u << (31 - k);
+	for (int d = 0; d < 3; ++d){
+		unsigned int s = degree[d];
+		unsigned int* v = mMatrices[d + 1];
+		for (unsigned int k = 0; k < 32; ++k){
+			if (k < s){
+				v[k] = initial[d][k] << (31 - k);
+				continue;
+			}
+			v[k] = v[k - s] ^ (v[k - s] >> s);
+			for (unsigned int j = 1; j < s; ++j){
+				if ((poly[d] >> (s - 1 - j)) & 1)
+					v[k] ^= v[k - j];
+			}
+		}
+	}
+}
+
+/**
+ * Returns the scrambled Sobol sample for the pixel (x,y).
+ */
+float SobolSampler::get(int x, int y, int index, int dim) const
+{
+	return sample(pixelSeed(x, y), index, dim);
+}
+
+/**
+ * Returns dimension dim of sample number index of the Sobol sequence
+ * scrambled with seed. The four dimensions of a group share the shuffled
+ * index, so they keep their joint stratification.
+ */
+float SobolSampler::sample(unsigned int seed, int index, int dim) const
+{
+	unsigned int groupSeed = hashCombine(seed, (unsigned int)dim / 4);
+	unsigned int i = nestedUniformScramble((unsigned int)index, groupSeed);
+	const unsigned int* m = mMatrices[dim % 4];
+	unsigned int v = 0;
+	for (int k = 0; i; i >>= 1, ++k){
+		if (i & 1)
+			v ^= m[k];
+	}
+	return toFloat(nestedUniformScramble(v, hashCombine(groupSeed, (unsigned int)dim % 4 + 1)));
+}
+
+/**
+ * Returns the scrambled radical inverse of index. The digits are permuted
+ * down to float precision, also beyond the last nonzero digit of the
+ * index, which makes the values uniform within their strata.
+ */
+float HaltonSampler::get(int x, int y, int index, int dim) const
+{
+	unsigned int base = primes[dim % numPrimes];
+	unsigned int prefix = hashCombine(pixelSeed(x, y), (unsigned int)dim);
+	unsigned int i = (unsigned int)index;
+	double f = 1.0 / base;
+	double v = 0.0;
+	while (f > 1e-8){
+		unsigned int digit = i % base;
+		i /= base;
+		v += permute(digit, base, prefix) * f;
+		prefix = hashCombine(prefix, digit);
+		f /= base;
+	}
+	return std::min((float)v, oneMinusEpsilon);
+}
+
+/**
+ * Creates a blue-noise dithered sampler. The mask is ranked by the
+ * void-and-cluster method of Ulichney, 1993: starting from an evenly
+ * spread pattern, the pixels are ordered so that each prefix of the order
+ * is as evenly spread as possible, measured by a Gaussian energy on the
+ * torus. The mask value of a pixel is its rank.
+ */
+BlueNoiseSampler::BlueNoiseSampler() : mMask(maskSize * maskSize)
+{
+	const int n = maskSize * maskSize;
+	const float sigma = 1.5f;
+
+	// Energy contributed by a pixel at each toroidal offset.
+	std::vector<float> kernel(n);
+	for (int dy = 0; dy < maskSize; ++dy){
+		for (int dx = 0; dx < maskSize; ++dx){
+			int ex = std::min(dx, maskSize - dx);
+			int ey = std::min(dy, maskSize - dy);
+			kernel[dy * maskSize + dx] = std::exp(-(float)(ex * ex + ey * ey) / (2.0f * sigma * sigma));
+		}
+	}
+
+	std::vector<unsigned char> pattern(n, 0);
+	std::vector<float> energy(n, 0.0f);
+	auto toggle = [&](int p, bool on) {
+		pattern[p] = on ? 1 : 0;
+		float sign = on ? 1.0f : -1.0f;
+		int px = p % maskSize, py = p / maskSize;
+		for (int y = 0; y < maskSize; ++y){
+			const float* row = &kernel[((y - py + maskSize) % maskSize) * maskSize];
+			for (int x = 0; x < maskSize; ++x)
+				energy[y * maskSize + x] += sign * row[(x - px + maskSize) % maskSize];
+		}
+	};
+	// Set pixel with the highest energy, the center of the tightest cluster.
+	auto tightestCluster = [&]() {
+		int best = -1;
+		for (int p = 0; p < n; ++p){
+			if (pattern[p] && (best < 0 || energy[p] > energy[best]))
+				best = p;
+		}
+		return best;
+	};
+	// Unset pixel with the lowest energy, the center of the largest void.
+	auto largestVoid = [&]() {
+		int best = -1;
+		for (int p = 0; p < n; ++p){
+			if (!pattern[p] && (best < 0 || energy[p] < energy[best]))
+				best = p;
+		}
+		return best;
+	};
+
+	// Initial pattern, a tenth of the pixels set at random, then moved
+	// from the tightest cluster to the largest void until it is even.
+	Random rng(1);
+	int ones = n / 10;
+	for (int k = 0; k < ones;){
+		int p = (int)(rng.next() % n);
+		if (!pattern[p]){
+			toggle(p, true);
+			++k;
+		}
+	}
+	for (int k = 0; k < n; ++k){
+		int cluster = tightestCluster();
+		toggle(cluster, false);
+		int hole = largestVoid();
+		toggle(hole, true);
+		if (hole == cluster)
+			break;
+	}
+	std::vector<unsigned char> initialPattern = pattern;
+	std::vector<float> initialEnergy = energy;
+
+	// The set pixels are ranked by removing the tightest clusters, the
+	// others by filling the largest voids. Filling voids also past half of
+	// the pixels, instead of removing clusters of unset pixels, gives
+	// masks of the same quality.
+	std::vector<int> rank(n);
+	for (int r = ones - 1; r >= 0; --r){
+		int cluster = tightestCluster();
+		toggle(cluster, false);
+		rank[cluster] = r;
+	}
+	pattern = initialPattern;
+	energy = initialEnergy;
+	for (int r = ones; r < n; ++r){
+		int hole = largestVoid();
+		toggle(hole, true);
+		rank[hole] = r;
+	}
+
+	for (int p = 0; p < n; ++p)
+		mMask[p] = ((float)rank[p] + 0.5f) / (float)n;
+}
+
+/**
+ * Returns the sample of the shared sequence, shifted by the mask value of
+ * the pixel. Each dimension reads the mask at its own offset, so that
+ * the shifts of different dimensions are not correlated.
+ */
+float BlueNoiseSampler::get(int x, int y, int index, int dim) const
+{
+	unsigned int offset = hashBits((unsigned int)dim + 1);
+	int mx = (int)(((unsigned int)x + (offset & 0xffff)) % maskSize);
+	int my = (int)(((unsigned int)y + (offset >> 16)) % maskSize);
+	float v = sample(0, index, dim) + mMask[my * maskSize + mx];
+	if (v >= 1.0f)
+		v -= 1.0f;
+	return std::min(v, oneMinusEpsilon);
+}
@@ -0,0 +1,134 @@
+/*
+*  sampler.h
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <vector>
+
+/**
+ * Base class for sample generators. A sampler returns the values of
+ * every sample as a function of its pixel, its index within the pixel and
+ * the dimension, so the same sample is returned whichever thread asks for
+ * it and in whatever order. Dimensions 0 and 1 are used for the position
+ * in the pixel, the tracers use the following ones in a fixed order for
+ * the lens, the bounces and so on, see PixelSample. All implementations
+ * are thread-safe.
+ */
+class Sampler
+{
+public:
+	virtual ~Sampler() {}
+
+	/// Returns dimension dim of sample number index in pixel (x,y), in the range [0,1).
+	virtual float get(int x, int y, int index, int dim) const = 0;
+};
+
+/**
+ * Uncorrelated random samples, each value is a hash of its pixel, index
+ * and dimension.
+ */
+class IndependentSampler : public Sampler
+{
+public:
+	float get(int x, int y, int index, int dim) const;
+};
+
+/**
+ * Jittered samples, stratified in pairs of dimensions. Pair 2k,2k+1 of
+ * the first samplesPerPixel samples covers an nx x ny grid of strata, at
+ * most one sample in each. The strata are visited in a different random
+ * order for each pixel and pair, so the pairs are not correlated.
+ */
+class StratifiedSampler : public Sampler
+{
+public:
+	explicit StratifiedSampler(int samplesPerPixel);
+
+	float get(int x, int y, int index, int dim) const;
+
+private:
+	int mStrataX;	///< Number of strata along the first dimension of a pair.
+	int mStrataY;	///< Number of strata along the second dimension of a pair.
+};
+
+/**
+ * Owen-scrambled Sobol samples, following Burley, "Practical Hash-based
+ * Owen Scrambling", JCGT 2020. The dimensions are taken in groups of four
+ * from the first four Sobol dimensions. Within each pixel and group, the
+ * sample index is shuffled and the values are scrambled with hashed nested
+ * uniform scrambling, so every power-of-two number of samples is well
+ * stratified, and groups and pixels are not correlated.
+ */
+class SobolSampler : public Sampler
+{
+public:
+	SobolSampler();
+
+	float get(int x, int y, int index, int dim) const;
+
+protected:
+	float sample(unsigned int seed, int index, int dim) const;
+
+	unsigned int mMatrices[4][32];	///< Generator matrices of the first four Sobol dimensions, one column per index bit.
+};
+
+/**
+ * Owen-scrambled Halton samples. Dimension d uses the radical inverse in
+ * the d:th prime base, with its digits permuted by hashes of the digits
+ * before them, seeded per pixel and dimension. Dimensions beyond the prime
+ * table reuse its bases with other seeds.
+ */
+class HaltonSampler : public Sampler
+{
+public:
+	float get(int x, int y, int index, int dim) const;
+};
+
+/**
+ * Blue-noise dithered Sobol samples, as described by Heitz and Belcour,
+ * "Distributing Monte Carlo Errors as a Blue Noise in Screen Space by
+ * Permuting Pixel Sequences", 2019. All pixels use the same scrambled
+ * Sobol sequence, shifted toroidally by a blue-noise mask made by the
+ * void-and-cluster method. The errors of nearby pixels are then negatively
+ * correlated and show up as high-frequency noise, which is less visible
+ * and goes away with any filtering.
+ */
+class BlueNoiseSampler : public SobolSampler
+{
+public:
+	BlueNoiseSampler();
+
+	float get(int x, int y, int index, int dim) const;
+
+private:
+	static const int maskSize = 64;		///< Width and height of the blue-noise mask.
+	std::vector<float> mMask;			///< Blue-noise values in [0,1), each once.
+};
+
+/**
+ * The dimensions of one sample, returned in order by next(). The tracing
+ * code passes it along a path and draws what it needs at each step.
+ */
+class PixelSample
+{
+public:
+	PixelSample() : mSampler(0), mX(0), mY(0), mIndex(0), mDim(0) { }
+	PixelSample(const Sampler* sampler, int x, int y, int index) : mSampler(sampler), mX(x), mY(y), mIndex(index), mDim(0) { }
+
+	/// Returns the next dimension of the sample.
+	float next() { return mSampler->get(mX, mY, mIndex, mDim++); }
+
+private:
+	const Sampler* mSampler;
+	int mX, mY;		///< Pixel of the sample.
+	int mIndex;		///< Index of the sample in its pixel.
+	int mDim;		///< Next dimension to return.
+};
+
+#endif
@@ -12,11 +12,26 @@
 #include "camera.h"
 #include "lightprobe.h"
 #include "scene.h"
+#include "timer.h"
+#include "allocationcounter.h"
+#include <algorithm>
+
+/// Number of lights that get a cached occluder, shadow rays towards
+/// further lights always go through the accelerator.
+static const int maxCachedOccluders = 16;
+
+/// Last occluder found by the calling thread towards each light, valid
+/// for the scene build identified by occluderVersion only.
+static THREAD_LOCAL Intersectable* lastOccluder[maxCachedOccluders];
+static THREAD_LOCAL unsigned int occluderVersion = 0;
+
+/// Version given to the next scene build, 0 is never used.
+static unsigned int nextSceneVersion = 1;
 
 /**
  * Initializes an empty scene.
  */
-Scene::Scene(RayAccelerator* accelerator) : mRoot(new Node()), mBackgroundProbe(0)
+Scene::Scene(RayAccelerator* accelerator) : mRoot(new Node()), mBackgroundProbe(0), mVersion(0)
 {
 	mAccelerator = accelerator;
 	std::cout << "creating scene" << std::endl;
@@ -71,13 +86,49 @@ void Scene::prepare()
 
 	// Extract scene data that will be needed during renderng.
 	mCameras.clear();
+	mPLights.clear();
 
-	std::vector<Intersectable*> geometry;
-	geometry.reserve(1000);
-	extractData(mRoot, geometry);
+	mGeometry.clear();
+	mGeometry.reserve(1000);
+	extractData(mRoot, mGeometry);
 	
 	// Build accelerator.
-	mAccelerator->build(geometry);
+	Timer timer;
+	mAccelerator->build(mGeometry);
+	mVersion = nextSceneVersion++;
+	std::cout << "accelerator built in " << timer.stop() << " seconds (" << mGeometry.size() << " primitives)" << std::endl;
+}
+
+/**
+ * Updates the scene after node transforms have been changed, e.g. between
+ * the frames of an animation. The transforms are propagated and the nodes
+ * prepared again as in prepare(). If the scene still contains the same
+ * primitives, the accelerator is refitted to their new bounds instead of
+ * rebuilt, otherwise it is rebuilt from scratch.
+ */
+void Scene::update()
+{
+	setupTransform(mRoot, Matrix());
+	prepareNode(mRoot);
+
+	mCameras.clear();
+	mPLights.clear();
+
+	std::vector<Intersectable*> geometry;
+	geometry.reserve(mGeometry.size());
+	extractData(mRoot, geometry);
+
+	Timer timer;
+	if (geometry == mGeometry) {
+		mAccelerator->refit(geometry);
+		std::cout << "accelerator refitted in " << timer.stop() << " seconds (" << geometry.size() << " primitives)" << std::endl;
+	}
+	else {
+		mGeometry.swap(geometry);
+		mAccelerator->build(mGeometry);
+		mVersion = nextSceneVersion++;
+		std::cout << "accelerator built in " << timer.stop() << " seconds (" << mGeometry.size() << " primitives)" << std::endl;
+	}
 }
 
 /**
@@ -168,7 +219,15 @@ void Scene::extractData(Node* node, std::vector<Intersectable*>& geometry)
  */
 bool Scene::intersect(const Ray& ray)
 {
+#ifdef COUNT_ALLOCATIONS
+	unsigned long allocations = getAllocationCount();
+	bool hit = mAccelerator->intersect(ray);
+	if (getAllocationCount() != allocations)
+		throw std::runtime_error("(Scene::intersect) heap allocation during ray traversal");
+	return hit;
+#else
 	return mAccelerator->intersect(ray);
+#endif
 }
 
 /**
@@ -177,5 +236,123 @@ bool Scene::intersect(const Ray& ray)
  */
 bool Scene::intersect(const Ray& ray, Intersection& is)
 {
+#ifdef COUNT_ALLOCATIONS
+	unsigned long allocations = getAllocationCount();
+	bool hit = mAccelerator->intersect(ray, is);
+	if (getAllocationCount() != allocations)
+		throw std::runtime_error("(Scene::intersect) heap allocation during ray traversal");
+	return hit;
+#else
 	return mAccelerator->intersect(ray, is);
+#endif
+}
+
+/**
+ * Returns true if the shadow ray towards light number light (starting at 0)
+ * is blocked. The occluder found last time by the calling thread for the
+ * same light is tested first, since neighboring shading points tend to be
+ * shadowed by the same primitive, and only if it misses is the accelerator
+ * traversed.
+ */
+bool Scene::intersectShadow(const Ray& ray, int light)
+{
+	if (light < 0 || light >= maxCachedOccluders)
+		return intersect(ray);
+
+	if (occluderVersion != mVersion) {
+		std::fill(lastOccluder, lastOccluder + maxCachedOccluders, (Intersectable*)0);
+		occluderVersion = mVersion;
+	}
+	Intersectable*& cached = lastOccluder[light];
+	if (cached && cached->intersect(ray))
+		return true;
+
+#ifdef COUNT_ALLOCATIONS
+	unsigned long allocations = getAllocationCount();
+	cached = mAccelerator->findOccluder(ray);
+	if (getAllocationCount() != allocations)
+		throw std::runtime_error("(Scene::intersectShadow) heap allocation during ray traversal");
+#else
+	cached = mAccelerator->findOccluder(ray);
+#endif
+	return cached != 0;
+}
+
+/**
+ * Finds the closest hit of each ray in the packet, returned in is[i] for
+ * rays[i]. Returns a bit mask of the rays that hit the scene.
+ */
+unsigned int Scene::intersect(const RayPacket& packet, Intersection* is)
+{
+#ifdef COUNT_ALLOCATIONS
+	unsigned long allocations = getAllocationCount();
+	unsigned int hits = mAccelerator->intersect(packet, is);
+	if (getAllocationCount() != allocations)
+		throw std::runtime_error("(Scene::intersect) heap allocation during ray traversal");
+	return hits;
+#else
+	return mAccelerator->intersect(packet, is);
+#endif
+}
+
+/**
+ * Returns a bit mask of the shadow rays in the packet that are blocked on
+ * their way to light number light. Same as intersectShadow(const Ray&, int)
+ * for each ray: the cached occluder is tried first, and the rays it does
+ * not block are traced as one packet. The cache keeps the last occluder
+ * found by the packet.
+ */
+unsigned int Scene::intersectShadow(const RayPacket& packet, int light)
+{
+	Intersectable* occluders[RayPacket::maxSize];
+	if (light < 0 || light >= maxCachedOccluders)
+		return findOccluders(packet, occluders);
+
+	if (occluderVersion != mVersion) {
+		std::fill(lastOccluder, lastOccluder + maxCachedOccluders, (Intersectable*)0);
+		occluderVersion = mVersion;
+	}
+	Intersectable*& cached = lastOccluder[light];
+
+	unsigned int blocked = 0;
+	RayPacket rest;
+	int index[RayPacket::maxSize];
+	for (int i = 0; i < packet.size; ++i) {
+		if (cached && cached->intersect(packet.rays[i])) {
+			blocked |= 1u << i;
+		}
+		else {
+			index[rest.size] = i;
+			rest.add(packet.rays[i]);
+		}
+	}
+	if (rest.size == 0)
+		return blocked;
+
+	unsigned int restBlocked = findOccluders(rest, occluders);
+	cached = 0;
+	for (int i = 0; i < rest.size; ++i) {
+		if (restBlocked & (1u << i)) {
+			blocked |= 1u << index[i];
+			cached = occluders[i];
+		}
+	}
+	return blocked;
+}
+
+/**
+ * Finds occluders for the rays in the packet with the accelerator, see
+ * RayAccelerator::findOccluders().
+ */
+unsigned int Scene::findOccluders(const RayPacket& packet, Intersectable** occluders)
+{
+#ifdef COUNT_ALLOCATIONS
+	unsigned long allocations = getAllocationCount();
+	unsigned int blocked = mAccelerator->findOccluders(packet, occluders);
+	if (getAllocationCount() != allocations)
+		throw std::runtime_error("(Scene::intersectShadow) heap allocation during ray traversal");
+	return blocked;
+#else
+	return mAccelerator->findOccluders(packet, occluders);
+#endif
 }
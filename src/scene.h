@@ -31,7 +31,8 @@ class Intersectable;
  * for rendering by computing all transform matrices, setting up an
  * acceleration data structure, and caching necessary data.
  * A ray can be intersected tested against the scene by calling the
- * intersect() functions.
+ * intersect() functions. After moving nodes, update() brings the cached
+ * data and the acceleration structure up to date again.
  */
 class Scene
 {
@@ -41,6 +42,7 @@ public:
 	
 	void add(Node* node, Node* parent=0);
 	void prepare();
+	void update();
 	
 	void setBackground(const Color& c);
 	void setBackground(LightProbe* lp);
@@ -49,6 +51,9 @@ public:
 	// Ray-scene intersection tests
 	bool intersect(const Ray& ray);
 	bool intersect(const Ray& ray, Intersection& is);
+	bool intersectShadow(const Ray& ray, int light);
+	unsigned int intersect(const RayPacket& packet, Intersection* is);
+	unsigned int intersectShadow(const RayPacket& packet, int light);
 
 	/// Returns the number of cameras in the scene.
 	int getNumberOfCameras() const { return (int)mCameras.size(); }
@@ -67,6 +72,7 @@ private:
 	void setupTransform(Node* node, const Matrix& parent);
 	void prepareNode(Node* node);
 	void extractData(Node* node, std::vector<Intersectable*>& geometry);
+	unsigned int findOccluders(const RayPacket& packet, Intersectable** occluders);
 
 private:
 	Node* mRoot;							///< Ptr to root node in the scene hierarchy.
@@ -75,6 +81,8 @@ private:
 	Color mBackgroundColor;					///< Background color to use if not using light probe.
 	LightProbe* mBackgroundProbe;			///< Ptr to light probe or 0 if none.
 	RayAccelerator* mAccelerator;		///< kD-tree accelerator structure.
+	std::vector<Intersectable*> mGeometry;	///< Primitives of the last accelerator build.
+	unsigned int mVersion;					///< Identifies the current build in the threads' occluder caches.
 };
 
 #endif
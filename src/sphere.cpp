@@ -13,14 +13,14 @@
 /**
  * Creates a sphere primitive.
  */
-Sphere::Sphere() : Primitive(), mRadius(0.5f)
+Sphere::Sphere() : Primitive(), mRadius(0.5f), mHasWorldSphere(false)
 {
 }
 
 /**
  * Creates a sphere at origin with radius r and material m.
  */
-Sphere::Sphere(float r, Material* m) : Primitive(m), mRadius(r)
+Sphere::Sphere(float r, Material* m) : Primitive(m), mRadius(r), mHasWorldSphere(false)
 {
 }
 
@@ -42,12 +42,32 @@ void Sphere::setRadius(float r)
 /**
  * Prepare sphere for rendering. This function computes the world->object
  * transform (inverse of the mWorldTransform matrix), so that intersection
- * tests can be performed in object space.
+ * tests can be performed in object space. If the transform is a
+ * similarity, the world-space center and radius are computed as well.
  */
 void Sphere::prepare()
 {
 	// Compute inverse world transform.
 	mInvWorldTransform = mWorldTransform.inverse();
+
+	// The transform is a similarity if it is affine, and the columns of its
+	// upper 3x3 part are orthogonal and of equal length.
+	const Matrix& m = mWorldTransform;
+	Vector3D c0(m(0,0), m(1,0), m(2,0));
+	Vector3D c1(m(0,1), m(1,1), m(2,1));
+	Vector3D c2(m(0,2), m(1,2), m(2,2));
+	float s2 = c0.length2();
+	float eps = 1e-5f * s2;
+	mHasWorldSphere = m(3,0) == 0.0f && m(3,1) == 0.0f && m(3,2) == 0.0f && m(3,3) == 1.0f && s2 > 0.0f &&
+		std::fabs(c1.length2() - s2) <= eps && std::fabs(c2.length2() - s2) <= eps &&
+		std::fabs(c0.dot(c1)) <= eps && std::fabs(c0.dot(c2)) <= eps && std::fabs(c1.dot(c2)) <= eps;
+
+	Point3D c = mWorldTransform * Point3D(0.0f, 0.0f, 0.0f);
+	mWorldSphere.center[0] = c.x;
+	mWorldSphere.center[1] = c.y;
+	mWorldSphere.center[2] = c.z;
+	mWorldSphere.radius = mRadius * std::sqrt(s2);
+	mWorldSphere.sphere = this;
 }
 
 /**
@@ -88,13 +108,17 @@ bool Sphere::solveQuadratic(float A, float B, float C, float& t0, float& t1) con
 	return true;
 }
 
-// Implementation of the Intersectable interface.
+// Implementation of the Surface interface.
 
 /**
  * Returns true if the ray intersects the sphere.
  */
 bool Sphere::intersect(const Ray& ray) const
 {
+	float t;
+	if (mHasWorldSphere)
+		return mWorldSphere.intersect(ray, ray.maxT, t);
+
 	// First, translate the ray to object space.
 	Point3D o = mInvWorldTransform * ray.orig;
 	Vector3D d = mInvWorldTransform * ray.dir;
@@ -119,6 +143,14 @@ bool Sphere::intersect(const Ray& ray) const
  */
 bool Sphere::intersect(const Ray& ray, Intersection& isect) const
 {
+	float t;
+	if (mHasWorldSphere){
+		if (!mWorldSphere.intersect(ray, ray.maxT, t))
+			return false;
+		setIntersection(ray, t, isect);
+		return true;
+	}
+
 	// First, translate the ray to object space.
 	Point3D o = mInvWorldTransform * ray.orig;
 	Vector3D d = mInvWorldTransform * ray.dir;
@@ -135,9 +167,18 @@ bool Sphere::intersect(const Ray& ray, Intersection& isect) const
 	if(t0>ray.maxT || t1<ray.minT) return false;	// sphere before/after ray	
 	if(t0<ray.minT && t1>ray.maxT) return false;	// ray inside sphere
 
+	t = t0<ray.minT ? t1 : t0;		// ray hit time
+	setIntersection(ray, t, isect);
+	return true;
+}
+
+/**
+ * Fills in isect for a hit at distance t along the ray.
+ */
+void Sphere::setIntersection(const Ray& ray, float t, Intersection& isect) const
+{
 	// Compute hit position & normal at hit point.
-	float t = t0<ray.minT ? t1 : t0;		// ray hit time
-	Point3D p = o + t*d;						// hit point in object space
+	Point3D p = mInvWorldTransform * (ray.orig + t*ray.dir);	// hit point in object space
 	Vector3D n = p;				// since sphere is centered about origin in object space,
 	n /= mRadius;
 	
@@ -152,6 +193,7 @@ bool Sphere::intersect(const Ray& ray, Intersection& isect) const
 	// Compute info about the intersection point.
 	isect.mRay = ray;
 	isect.mObject = this;					// The object by the ray (this object itself).
+	isect.mInstance = 0;
 	isect.mMaterial = getMaterial();		// Store ptr to the material.
 	isect.mHitTime = t;						// Store hit time parameter t.
 	isect.mPosition = mWorldTransform * p;	// Store world space hit point.
@@ -162,8 +204,6 @@ bool Sphere::intersect(const Ray& ray, Intersection& isect) const
 	if (!isect.mFrontFacing) isect.mNormal = -isect.mNormal;
 	isect.mTexture = UV(u,v);				// Use spherical coordinates as texture coords.
 	isect.mHitParam = UV(u,v);				// Store spherical coordinates.
-
-	return true;
 }
 
 /**
@@ -175,6 +215,14 @@ void Sphere::getAABB(AABB& bb) const
 	// we compute the location of the eight corners of a box enclosing the sphere
 	// in object space, and then setup the box that includes all corners translated
 	// to world space. This works but is not always optimal.
+	// A sphere under a similarity transform gets a tight box instead.
+	if (mHasWorldSphere){
+		const float* c = mWorldSphere.center;
+		float r = mWorldSphere.radius;
+		bb = AABB(Point3D(c[0]-r, c[1]-r, c[2]-r), Point3D(c[0]+r, c[1]+r, c[2]+r));
+		return;
+	}
+
 	bb = AABB();
 	
 	for(int i = 0; i < 8; i++) {
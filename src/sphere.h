@@ -13,15 +13,58 @@
 #include "primitive.h"
 #include "intersectable.h"
 
+class Sphere;
+
+/**
+ * World-space center and radius of a sphere, together with the sphere
+ * itself. Only valid for spheres whose transform is a similarity, i.e.
+ * made of rotations, uniform scalings and translations, which keeps the
+ * sphere a sphere. The ray can then be intersected without transforming
+ * it to object space first.
+ */
+struct WorldSphere {
+	float center[3];
+	float radius;
+	const Sphere* sphere;
+
+	/**
+	 * Returns true if the ray hits the sphere between ray.minT and maxT,
+	 * with the hit distance in t. Same rules as Sphere::intersect(): a ray
+	 * starting inside the sphere hits its far side.
+	 */
+	bool intersect(const Ray& ray, float maxT, float& t) const
+	{
+		float ox = ray.orig.x - center[0];
+		float oy = ray.orig.y - center[1];
+		float oz = ray.orig.z - center[2];
+		float A = ray.dir.x*ray.dir.x + ray.dir.y*ray.dir.y + ray.dir.z*ray.dir.z;
+		float B = 2.0f * (ray.dir.x*ox + ray.dir.y*oy + ray.dir.z*oz);
+		float C = ox*ox + oy*oy + oz*oz - radius*radius;
+
+		float d = B*B - 4.0f*A*C;
+		if (d < 0.0f)
+			return false;
+		d = std::sqrt(d);
+		float t0 = (-B - d) / (2.0f*A);
+		float t1 = (-B + d) / (2.0f*A);
+
+		if (t0 > maxT || t1 < ray.minT) return false;
+		if (t0 < ray.minT && t1 > maxT) return false;
+		t = t0 < ray.minT ? t1 : t0;
+		return true;
+	}
+};
+
 /**
  * Class representing a sphere.
  * The sphere has a radius and is centered around origin by default.
  * By setting its transform, the translation/scale/orientation can
  * be changed. The ray/sphere intersection is done by transforming the
  * ray to object space, and solving the quadratic equation for the
- * sphere: x^2 + y^2 + z^2 = r^2.
+ * sphere: x^2 + y^2 + z^2 = r^2. If the transform is a similarity,
+ * the sphere is instead intersected in world space, see WorldSphere.
  */
-class Sphere : public Primitive, public Intersectable
+class Sphere : public Primitive, public Surface
 {
 public:
 	Sphere();
@@ -29,8 +72,16 @@ public:
 	virtual ~Sphere();
 
 	void setRadius(float r);
+
+	/**
+	 * Returns true if the sphere has a world-space center and radius,
+	 * which are then returned in ws. Valid after prepare().
+	 */
+	bool getWorldSphere(WorldSphere& ws) const { ws = mWorldSphere; return mHasWorldSphere; }
+
+	void setIntersection(const Ray& ray, float t, Intersection& isect) const;
 	
-	// Implementation of the Intersectable interface.
+	// Implementation of the Surface interface.
 	bool intersect(const Ray& ray) const;
 	bool intersect(const Ray& ray, Intersection& isect) const;
 	void getAABB(AABB& bb) const;
@@ -45,6 +96,8 @@ protected:
 protected:
 	float mRadius;					///< Radius of sphere.
 	Matrix mInvWorldTransform;		///< World->Object transform.	
+	WorldSphere mWorldSphere;		///< World-space sphere, only valid if mHasWorldSphere is set.
+	bool mHasWorldSphere;			///< True if the world transform is a similarity.
 };
 
 #endif
@@ -10,27 +10,29 @@
 #ifndef TIMER_H
 #define TIMER_H
 
-#include <ctime>
+#include <chrono>
 
 /**
  * Class representing a simple timer. 
  * This class is useful for measuring rendering times etc.
+ * The timer measures wall-clock time, std::clock() would add up
+ * the CPU time of all threads on some platforms.
  */
 class Timer
 {
 public:
 	/// Constructs a timer initialized to the current time.
-	Timer() : mStart(std::clock()) { }
+	Timer() : mStart(std::chrono::steady_clock::now()) { }
 	
 	/// Starts the timer.
-	void start() { mStart = std::clock(); }
+	void start() { mStart = std::chrono::steady_clock::now(); }
 	
 	/// Stops the timer and returns the time in seconds since the object was
 	/// constructed, or since last call to start().
-	float stop() { return (float)(std::clock()-mStart)/(float)CLOCKS_PER_SEC; }
+	float stop() { return std::chrono::duration<float>(std::chrono::steady_clock::now()-mStart).count(); }
 
 protected:
-	std::clock_t mStart;		///< Start time in ticks.
+	std::chrono::steady_clock::time_point mStart;		///< Start time.
 };
 
 #endif
@@ -0,0 +1,38 @@
+/*
+ *  traversalstack.h
+ *  prTracer
+ *
+ *  Copyright 2011 Lund University. All rights reserved.
+ *
+ */
+
+#ifndef TRAVERSALSTACK_H
+#define TRAVERSALSTACK_H
+
+/**
+ * Fixed-capacity stack used by the acceleration structure traversals.
+ * It lives entirely on the call stack, so tracing a ray does not touch
+ * the heap. The interface mirrors std::stack. The capacity must cover
+ * the deepest tree the owning accelerator can build; each accelerator
+ * checks its measured tree depth against it after building.
+ */
+template<class T, int N>
+class TraversalStack
+{
+public:
+	TraversalStack() : mSize(0) { }
+
+	void push(const T& item) { mItems[mSize++] = item; }
+	void pop() { --mSize; }
+	const T& top() const { return mItems[mSize - 1]; }
+	bool empty() const { return mSize == 0; }
+
+	/// Returns the maximum number of items the stack can hold.
+	static int capacity() { return N; }
+
+private:
+	T mItems[N];		///< Stack storage.
+	int mSize;			///< Number of items currently on the stack.
+};
+
+#endif
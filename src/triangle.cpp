@@ -18,19 +18,16 @@ static const float overlap = 1e-3f;
 /**
 * Constructor.
 */
-Triangle::Triangle() : mMesh(0)
+Triangle::Triangle() : mMesh(0), mIndex(0)
 {
 }
 
 /**
-* Constructor initializing the triangle with the given vertices.
+* Constructor initializing the triangle as number index of the owner mesh.
+* Its vertices and material are those stored at that index by the mesh.
 */
-Triangle::Triangle(Mesh* owner, const vertex& vtx1, const vertex& vtx2, const vertex& vtx3, Material *mtl) : mMesh(owner)
+Triangle::Triangle(const Mesh* owner, unsigned int index) : mMesh(owner), mIndex(index)
 {
-	mVtx[0] = vtx1;
-	mVtx[1] = vtx2;
-	mVtx[2] = vtx3;
-	mMaterial = mtl;
 }
 
 /**
@@ -59,7 +56,7 @@ float Triangle::getArea() const
 	return a;
 }
 
-// Implementation of the Intersectable interface.
+// Implementation of the Surface interface.
 
 /**
 * Returns true if the ray intersects the triangle.
@@ -80,7 +77,7 @@ bool Triangle::intersect(const Ray& ray) const
 
 	Vector3D N = e1 % e2;
 	float s = -D * N;
-	if (abs(s) < eps)
+	if (std::fabs(s) < eps)
 		return false;
 
 	float s_inv = 1 / s;
@@ -121,7 +118,7 @@ bool Triangle::intersect(const Ray& ray, Intersection& isect) const
 
 	Vector3D N = e1 % e2;
 	float s = -D * N;
-	if (abs(s) < eps)
+	if (std::fabs(s) < eps)
 		return false;
 
 	float s_inv = 1 / s;
@@ -140,11 +137,23 @@ bool Triangle::intersect(const Ray& ray, Intersection& isect) const
 	if (w < 0 || v + w > 1)
 		return false;
 
+	setIntersection(ray, t, v, w, isect);
+	return true;
+}
+
+/**
+* Fills in the information about a hit at distance t along the ray, with
+* barycentric coordinates v and w of vertex 1 and 2. Used by intersect()
+* and by accelerators that test triangles in packs.
+*/
+void Triangle::setIntersection(const Ray& ray, float t, float v, float w, Intersection& isect) const
+{
 	float u = 1 - v - w;
 
 	// Compute information about the hit point
 	isect.mRay = ray;
 	isect.mObject = this;						// Store ptr to the object hit by the ray (this).
+	isect.mInstance = 0;
 	isect.mMaterial = getMaterial();
 	if (!isect.mMaterial)
 		isect.mMaterial = mMesh->getMaterial();		// Store ptr to the material at the hit point.
@@ -157,8 +166,6 @@ bool Triangle::intersect(const Ray& ray, Intersection& isect) const
 	isect.mTexture = u*getVtxTexture(0) + v*getVtxTexture(1) + w*getVtxTexture(2);
 	isect.mHitTime = t;
 	isect.mHitParam = UV(u, v);
-
-	return true;
 }
 
 
@@ -170,7 +177,43 @@ void Triangle::getAABB(AABB& bb) const
 	bb = AABB(getVtxPosition(0), getVtxPosition(1), getVtxPosition(2));
 }
 
-void Triangle::prepare()
+/**
+* Returns the bounding boxes of the parts of the triangle on each side of
+* the plane at position along axis. The edges crossing the plane are
+* clipped, so the boxes are tight around the two polygons.
+*/
+void Triangle::splitAABB(int axis, float position, AABB& left, AABB& right) const
+{
+	left = AABB();
+	right = AABB();
+	for (int i = 0; i < 3; i++) {
+		const Point3D& p0 = getVtxPosition(i);
+		const Point3D& p1 = getVtxPosition((i + 1) % 3);
+		float d0 = p0(axis);
+		float d1 = p1(axis);
+
+		if (d0 <= position)
+			left.include(p0);
+		if (d0 >= position)
+			right.include(p0);
+
+		if ((d0 < position && d1 > position) || (d0 > position && d1 < position)) {
+			float t = (position - d0) / (d1 - d0);
+			Point3D p = p0 + t * Vector3D(p1 - p0);
+			p(axis) = position;
+			left.include(p);
+			right.include(p);
+		}
+	}
+}
+
+/**
+* Computes the planes used for the ray differentials. Plane i is 1 at
+* vertex i and 0 along the opposite edge, so its value at a point is the
+* barycentric coordinate of vertex i. They are only needed for the
+* differentials, so they are computed when asked for rather than stored.
+*/
+void Triangle::computePlanes(Vector3D planes[3], Vector3D& offsets) const
 {
 	Vector3D n = getFaceNormal();
 
@@ -189,38 +232,55 @@ void Triangle::prepare()
 		float f = 1.0f / (b - a);
 		float d = 1.0f - f*b;
 
-		mPlanes[i] = f * np;
-		mPlaneOffsets(i) = d;
+		planes[i] = f * np;
+		offsets(i) = d;
 	}
 }
 
+/// Returns the three vertices of the triangle in the mesh's index buffer.
+inline const Triangle::vertex* Triangle::getVertices() const
+{
+	return &mMesh->mIndices[3 * mIndex];
+}
+
 /// Returns the position of vertex i=[0,1,2].
 const Point3D& Triangle::getVtxPosition(int i) const
 {
-	return mMesh->mVtxP[mVtx[i].p];
+	return mMesh->mVtxP[getVertices()[i].p];
 }
 
 /// Returns the normal of vertex i=[0,1,2].
 const Vector3D& Triangle::getVtxNormal(int i) const
 {
-	return mMesh->mVtxN[mVtx[i].n];
+	return mMesh->mVtxN[getVertices()[i].n];
 }
 
 /// Returns the texture coordinate of vertex i=[0,1,2].
 const UV& Triangle::getVtxTexture(int i) const
 {
-	return mMesh->mVtxUV[mVtx[i].t];
+	return mMesh->mVtxUV[getVertices()[i].t];
+}
+
+/// Returns the material of the triangle, or 0 if it uses the mesh's material.
+Material* Triangle::getMaterial() const
+{
+	unsigned short id = mMesh->mFaceMaterials[mIndex];
+	return id == Mesh::meshMaterial ? 0 : mMesh->mMaterials[id];
 }
 
 UV Triangle::calculateTextureDifferential(const Point3D& p, const Vector3D& dp) const
 {
-	return mPlanes[0].dot(dp)*getVtxTexture(0) + mPlanes[1].dot(dp)*getVtxTexture(1) + mPlanes[2].dot(dp)*getVtxTexture(2);
+	Vector3D planes[3], offsets;
+	computePlanes(planes, offsets);
+	return planes[0].dot(dp)*getVtxTexture(0) + planes[1].dot(dp)*getVtxTexture(1) + planes[2].dot(dp)*getVtxTexture(2);
 }
 
 Vector3D Triangle::calculateNormalDifferential(const Point3D& p, const Vector3D& dp, bool isFrontFacing) const
 {
-	Vector3D n = (mPlanes[0].dot(p) + mPlaneOffsets.x)*getVtxNormal(0) + (mPlanes[1].dot(p) + mPlaneOffsets.y)*getVtxNormal(1) + (mPlanes[2].dot(p) + mPlaneOffsets.z)*getVtxNormal(2);
-	Vector3D dn = mPlanes[0].dot(dp)*getVtxNormal(0) + mPlanes[1].dot(dp)*getVtxNormal(1) + mPlanes[2].dot(dp)*getVtxNormal(2);
+	Vector3D planes[3], offsets;
+	computePlanes(planes, offsets);
+	Vector3D n = (planes[0].dot(p) + offsets.x)*getVtxNormal(0) + (planes[1].dot(p) + offsets.y)*getVtxNormal(1) + (planes[2].dot(p) + offsets.z)*getVtxNormal(2);
+	Vector3D dn = planes[0].dot(dp)*getVtxNormal(0) + planes[1].dot(dp)*getVtxNormal(1) + planes[2].dot(dp)*getVtxNormal(2);
 
 	float sign = isFrontFacing ? 1.0f : -1.0f;
 
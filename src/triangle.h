@@ -18,9 +18,11 @@ class Mesh;
  * Class representing a single triangle. 
  * This class is used by Mesh to represent the triangles in the mesh.
  * It has functions for computing the triangle's face normal, area,
- * and for intersection testing with a ray.
+ * and for intersection testing with a ray. To keep large meshes small,
+ * a triangle only stores its owner and its index in the mesh; the vertex
+ * indices and material id are kept in the mesh's shared arrays.
  */
-class Triangle : public Intersectable
+class Triangle : public Surface
 {	
 public:
 	/// \cond INTERNAL_CLASS
@@ -36,30 +38,32 @@ public:
 	/// \endcond // INTERNAL_CLASS
 
 	Triangle();
-	Triangle(Mesh* owner, const vertex& vtx1, const vertex& vtx2, const vertex& vtx3, Material *mtl);
+	Triangle(const Mesh* owner, unsigned int index);
 	
 	Vector3D getFaceNormal() const;
 	float getArea() const;
-	void prepare();
 
-	// Implementation of the Intersectable interface:
+	// Implementation of the Surface interface:
 	bool intersect(const Ray& ray) const;
 	bool intersect(const Ray& ray, Intersection& isect) const;
+	void setIntersection(const Ray& ray, float t, float v, float w, Intersection& isect) const;
 	void getAABB(AABB& bb) const;
+	void splitAABB(int axis, float position, AABB& left, AABB& right) const;
 	UV calculateTextureDifferential(const Point3D& p, const Vector3D& dp) const;
 	Vector3D calculateNormalDifferential(const Point3D& p, const Vector3D& dp, bool isFrontFacing) const;
 
 	const Point3D& getVtxPosition(int i) const;
 	const Vector3D& getVtxNormal(int i) const;
 	const UV& getVtxTexture(int i) const;
-	Material *getMaterial() const {return mMaterial;}
+	Material *getMaterial() const;
 
 protected:
-	Vector3D mPlanes[3];
-	Vector3D mPlaneOffsets;
-	Mesh* mMesh;				///< Ptr to the mesh this triangle belongs to.
-	vertex mVtx[3];				///< The three vertices of the triangle.	
-	Material *mMaterial;		///< Material of the triangle.
+	const vertex* getVertices() const;
+	void computePlanes(Vector3D planes[3], Vector3D& offsets) const;
+
+protected:
+	const Mesh* mMesh;			///< Ptr to the mesh this triangle belongs to.
+	unsigned int mIndex;		///< Index of the triangle in the mesh.
 
 	friend class Mesh;
 };
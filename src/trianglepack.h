@@ -0,0 +1,90 @@
+/*
+*  trianglepack.h
+*  prTracer
+*
+*  Copyright 2011 Lund University. All rights reserved.
+*
+*/
+
+#ifndef TRIANGLEPACK_H
+#define TRIANGLEPACK_H
+
+#include <xmmintrin.h>
+#include "triangle.h"
+#include "ray.h"
+
+/**
+ * Four triangles in structure-of-arrays layout, intersected with one ray
+ * at a time using SSE. Vertex 0, the two edges from it and the unnormalized
+ * face normal are precomputed, so a test needs no indirect vertex loads and
+ * no virtual call. The arithmetic is the same as in Triangle::intersect(),
+ * so both give the same hits. Unused lanes have a zero normal and never hit.
+ */
+struct TrianglePack {
+	__m128 v0[3];				///< Vertex 0, x, y and z of the four triangles.
+	__m128 e1[3];				///< Edge from vertex 0 to vertex 1.
+	__m128 e2[3];				///< Edge from vertex 0 to vertex 2.
+	__m128 n[3];				///< Cross product of e1 and e2.
+	const Triangle* tri[4];		///< Owning triangle of each lane, 0 for unused lanes.
+
+	/// Clears all lanes.
+	void clear()
+	{
+		for (int k = 0; k < 3; ++k)
+			v0[k] = e1[k] = e2[k] = n[k] = _mm_setzero_ps();
+		for (int i = 0; i < 4; ++i)
+			tri[i] = 0;
+	}
+
+	/// Stores triangle t in lane i.
+	void set(int i, const Triangle* t)
+	{
+		Vector3D p0 = t->getVtxPosition(0);
+		Vector3D a = t->getVtxPosition(1) - t->getVtxPosition(0);
+		Vector3D b = t->getVtxPosition(2) - t->getVtxPosition(0);
+		Vector3D c = a % b;
+		for (int k = 0; k < 3; ++k) {
+			((float*)&v0[k])[i] = p0(k);
+			((float*)&e1[k])[i] = a(k);
+			((float*)&e2[k])[i] = b(k);
+			((float*)&n[k])[i] = c(k);
+		}
+		tri[i] = t;
+	}
+
+	/**
+	 * Intersects the ray with the four triangles. Returns a bit mask of the
+	 * lanes hit strictly between ray.minT and maxT, with the hit distances
+	 * in t and the barycentric coordinates of vertex 1 and 2 in v and w.
+	 */
+	int intersect(const Ray& ray, float maxT, __m128& t, __m128& v, __m128& w) const
+	{
+		const __m128 signMask = _mm_set1_ps(-0.0f);
+		const __m128 zero = _mm_setzero_ps();
+		__m128 d[3] = { _mm_set1_ps(-ray.dir.x), _mm_set1_ps(-ray.dir.y), _mm_set1_ps(-ray.dir.z) };
+
+		__m128 s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], n[0]), _mm_mul_ps(d[1], n[1])), _mm_mul_ps(d[2], n[2]));
+		__m128 valid = _mm_cmpge_ps(_mm_andnot_ps(signMask, s), _mm_set1_ps(0.00001f));
+		__m128 sInv = _mm_div_ps(_mm_set1_ps(1.0f), s);
+
+		__m128 r[3] = { _mm_sub_ps(_mm_set1_ps(ray.orig.x), v0[0]), _mm_sub_ps(_mm_set1_ps(ray.orig.y), v0[1]), _mm_sub_ps(_mm_set1_ps(ray.orig.z), v0[2]) };
+		t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r[0], n[0]), _mm_mul_ps(r[1], n[1])), _mm_mul_ps(r[2], n[2])), sInv);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(ray.minT)), _mm_cmplt_ps(t, _mm_set1_ps(maxT))));
+		if (!_mm_movemask_ps(valid))
+			return 0;
+
+		__m128 q[3] = {
+			_mm_sub_ps(_mm_mul_ps(d[1], r[2]), _mm_mul_ps(d[2], r[1])),
+			_mm_sub_ps(_mm_mul_ps(d[2], r[0]), _mm_mul_ps(d[0], r[2])),
+			_mm_sub_ps(_mm_mul_ps(d[0], r[1]), _mm_mul_ps(d[1], r[0]))
+		};
+		v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(q[0], e2[0]), _mm_mul_ps(q[1], e2[1])), _mm_mul_ps(q[2], e2[2])), sInv);
+		__m128 e1q = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], q[0]), _mm_mul_ps(e1[1], q[1])), _mm_mul_ps(e1[2], q[2]));
+		w = _mm_mul_ps(_mm_xor_ps(e1q, signMask), sInv);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmpge_ps(w, zero)));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(v, w), _mm_set1_ps(1.0f)));
+		return _mm_movemask_ps(valid);
+	}
+};
+
+#endif
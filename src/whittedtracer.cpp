@@ -15,10 +15,12 @@
 #include "material.h"
 #include "whittedtracer.h"
 #include "timer.h"
+#include "raystats.h"
 #include "image.h"
+#include "raypacket.h"
+#include "sampler.h"
 
 const float nbrSamples = 16.0;
-const float samplesPerAxis = 4.0;
 const int iSamplesPerAxis = 4;
 const bool sampling = true;
 const int maxDepth = 1;
@@ -41,43 +43,34 @@ WhittedTracer::~WhittedTracer()
 }
 
 /**
- * Raytraces the scene by calling tracePixel() for each pixel in the output image.
- * The function tracePixel() is responsible for computing the output color of the
- * pixel. This should be done in a sub class derived from the Raytracer base class.
+ * Raytraces the scene tile by tile on all threads, see renderTile().
  */
 void WhittedTracer::computeImage()
 {
 	std::cout << "Raytracing..." << std::endl;
 	Timer timer;
-	
-	Color c;
-	int width = mImage->getWidth();
-	int height = mImage->getHeight();
+	resetRayStatistics();
 	
 	Point3D pointInFocalPlane = mCamera->mOrigin + mCamera->mForward * focalDistance;
 
-	// Loop over all pixels in the image
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			// Raytrace the pixel at (x,y).
-			
+	renderTiles();
 
-			c = (DOF) ? tracePixelDOF(x,y) : tracePixel(x,y);
-			
-			// Store the result in the image.
+	std::cout << "Done in: " << timer.stop() << " seconds" << std::endl;
+	printRayStatistics(std::cout);
+}
+
+/**
+ * Raytraces the pixels of a tile by calling tracePixel() or tracePixelDOF()
+ * for each of them, and stores the results in the image.
+ */
+void WhittedTracer::renderTile(int x0, int y0, int x1, int y1)
+{
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			Color c = (DOF) ? tracePixelDOF(x,y) : tracePixel(x,y);
 			mImage->setPixel(x,y,c);
 		}
-		
-		// Print progress approximately every 5%.
-		if ((y + 1) % (height / 20) == 0 || (y + 1) == height){
-			std::cout << (100 * (y + 1) / height) << "% done" << std::endl;
-			//std::cout << "Rays/second: " << nbrRays / timer.stop() << std::endl;
-			//std::cout << "Rays: " << nbrRays << std::endl;
-			//std::cout << "Time: " << timer.stop() << std::endl;
-		}
 	}
-	//std::cout << "Total number of rays: " << nbrRays << std::endl;
-	std::cout << "Done in: " << timer.stop() << " seconds" << std::endl;
 }
 
 /**
@@ -89,16 +82,19 @@ Color WhittedTracer::tracePixel(int x, int y)
 {
 	Color pixelColor = Color(0.0f, 0.0f, 0.0f);
 
-	//super sampling, samples / pixel
+	//super sampling, samples / pixel, traced as one packet
 	if (sampling){
-		for (int i = 0; i < iSamplesPerAxis; ++i){
-			for (int j = 0; j < iSamplesPerAxis; ++j){
-				float cx = (float)x + j / samplesPerAxis + uniform() / samplesPerAxis;
-				float cy = (float)y + i / samplesPerAxis + uniform() / samplesPerAxis;
-				Ray ray = mCamera->getRay(cx, cy);
-				pixelColor += trace(ray, 0);
-			}
+		RayPacket packet;
+		for (int i = 0; i < iSamplesPerAxis * iSamplesPerAxis; ++i){
+			PixelSample sample(mSampler, x, y, i);
+			float cx = (float)x + sample.next();
+			float cy = (float)y + sample.next();
+			packet.add(mCamera->getRay(cx, cy));
 		}
+		Color colors[RayPacket::maxSize];
+		tracePacket(packet, colors);
+		for (int i = 0; i < packet.size; ++i)
+			pixelColor += colors[i];
 		pixelColor /= nbrSamples;
 	}
 	else{
@@ -145,35 +141,38 @@ Color WhittedTracer::tracePixelDOF(int x, int y)
 {
 	Color pixelColor = Color(0.0f, 0.0f, 0.0f);
 
-//super sampling, samples / pixel
-	
-	for (int i = 0; i < iSamplesPerAxis; ++i){
-		for (int j = 0; j < iSamplesPerAxis; ++j){
-			float cx = (float)x + j / samplesPerAxis + uniform() / samplesPerAxis;
-			float cy = (float)y + i / samplesPerAxis + uniform() / samplesPerAxis;
-		}
-	}
-	pixelColor /= nbrSamples;
 	Ray initRay = mCamera->getRay(x, y);
 	Intersection is;
 	if (!rayFocalPlaneIntersect(initRay, mCamera, is)){
 		std::cout << "ooops!" << std::endl;
 	}
 
+	// The lens samples all converge on the same point of the focal plane,
+	// so they are traced in packets.
+	RayPacket packet;
+	Color colors[RayPacket::maxSize];
 	for (int i = 0; i < DOFSamples; ++i){
-		float sX = 2;
-		float sY = 2;
-		while (sX*sX + sY*sY > 1){
-			sX = uniform() * 2 - 1;
-			sY = uniform() * 2 - 1;
-		}
+		// Uniform point on the lens from the first two sample dimensions.
+		PixelSample sample(mSampler, x, y, i);
+		float r = std::sqrt(sample.next());
+		float phi = 2.0f * M_PI * sample.next();
+		float sX = r * std::cos(phi);
+		float sY = r * std::sin(phi);
 		Point3D startPos = mCamera->mOrigin +
 			mCamera->mRight * sX * DOFLensRadius +
 			mCamera->mUp * sY * DOFLensRadius;
 		Ray ray;
 		ray.orig = startPos;
 		ray.dir = Vector3D(is.mPosition - startPos).normalize();
-		pixelColor += trace(ray, 0);
+		ray.updateTraversalData();
+		ray.primary = true;
+		packet.add(ray);
+		if (packet.size == RayPacket::maxSize || i == DOFSamples - 1){
+			tracePacket(packet, colors);
+			for (int j = 0; j < packet.size; ++j)
+				pixelColor += colors[j];
+			packet.size = 0;
+		}
 	}
 
 	pixelColor /= DOFSamples;
@@ -186,42 +185,81 @@ Color WhittedTracer::tracePixelDOF(int x, int y)
  */
 Color WhittedTracer::trace(const Ray& ray, int depth)
 {
-	Color colorOut = Color(0,0,0);
 	Intersection is;
-	++nbrRays;
-	if (mScene->intersect(ray, is)){
-		Color reflectedC, refractedC, emittedC;
-		Material* m = is.mMaterial;
-		float reflectivity = m->getReflectivity(is);
-		float transparency = m->getTransparency(is);
-		if (depth < maxDepth){
-			reflectedC = trace(is.getReflectedRay(), depth + 1);
-			refractedC = trace(is.getRefractedRay(), depth + 1);
-		}
-		for (int i = 0; i < mScene->getNumberOfLights(); ++i){
-			PointLight* l = mScene->getLight(i);
-			if(!mScene->intersect(is.getShadowRay(l))){
-				Vector3D lightVec = l->getWorldPosition() - is.mPosition;
-				lightVec.normalize();
-				Color radiance = l->getRadiance();
-				Color brdf = is.mMaterial->evalBRDF(is, lightVec);
-				float angle = max(lightVec * is.mNormal, 0.0f);
-				emittedC += radiance * brdf * angle;
-			}
-			else{
-				Vector3D lightVec = l->getWorldPosition() - is.mPosition;
-				lightVec.normalize();
-				Color radiance = l->getRadiance();
-				Color brdf = is.mMaterial->evalBRDF(is, lightVec);
-				float angle = max(lightVec * is.mNormal, 0.0f);
-				emittedC += radiance * brdf * angle * 0.05 + Color(0.005f, 0.005f, 0.005f);
+	if (mScene->intersect(ray, is))
+		return shade(is, depth, 0, 0);
+	return Color(0,0,0);
+}
+
+/**
+ * Computes the radiance returned by each ray of the packet into colors.
+ * The rays are traced as one packet, and so are the shadow rays from
+ * their hits towards each light. Lights beyond the first 32 are tested
+ * one ray at a time by shade().
+ */
+void WhittedTracer::tracePacket(const RayPacket& packet, Color* colors)
+{
+	Intersection is[RayPacket::maxSize];
+	unsigned int hits = mScene->intersect(packet, is);
+
+	int packetLights = std::min(mScene->getNumberOfLights(), 32);
+	unsigned int occluded[RayPacket::maxSize] = { 0 };
+	for (int l = 0; l < packetLights && hits; ++l){
+		RayPacket shadow;
+		int index[RayPacket::maxSize];
+		for (int i = 0; i < packet.size; ++i){
+			if (hits & (1u << i)){
+				index[shadow.size] = i;
+				shadow.add(is[i].getShadowRay(mScene->getLight(l)));
 			}
 		}
-		colorOut = emittedC +refractedC * transparency + reflectedC * reflectivity;
-		//colorOut = emittedC *(1 - transparency - reflectivity) + refractedC * transparency + reflectedC * reflectivity;
-		//colorOut *= (1 - is.mMaterial->getReflectivity(is) - is.mMaterial->getTransparency(is));			
+		unsigned int blocked = mScene->intersectShadow(shadow, l);
+		for (int j = 0; j < shadow.size; ++j){
+			if (blocked & (1u << j))
+				occluded[index[j]] |= 1u << l;
+		}
 	}
-return colorOut;
-	
+
+	for (int i = 0; i < packet.size; ++i)
+		colors[i] = (hits & (1u << i)) ? shade(is[i], 0, occluded[i], packetLights) : Color(0,0,0);
+}
+
+/**
+ * Computes the radiance leaving the hit point is. Bit i of occluded tells
+ * whether light i is blocked, for the first knownLights lights; shadow
+ * rays are traced towards the others.
+ */
+Color WhittedTracer::shade(const Intersection& is, int depth, unsigned int occluded, int knownLights)
+{
+	Color reflectedC, refractedC, emittedC;
+	Material* m = is.mMaterial;
+	float reflectivity = m->getReflectivity(is);
+	float transparency = m->getTransparency(is);
+	if (depth < maxDepth){
+		reflectedC = trace(is.getReflectedRay(), depth + 1);
+		refractedC = trace(is.getRefractedRay(), depth + 1);
+	}
+	for (int i = 0; i < mScene->getNumberOfLights(); ++i){
+		PointLight* l = mScene->getLight(i);
+		bool blocked = i < knownLights ? ((occluded >> i) & 1) != 0 : mScene->intersectShadow(is.getShadowRay(l), i);
+		if(!blocked){
+			Vector3D lightVec = l->getWorldPosition() - is.mPosition;
+			lightVec.normalize();
+			Color radiance = l->getRadiance();
+			Color brdf = is.mMaterial->evalBRDF(is, lightVec);
+			float angle = max(lightVec * is.mNormal, 0.0f);
+			emittedC += radiance * brdf * angle;
+		}
+		else{
+			Vector3D lightVec = l->getWorldPosition() - is.mPosition;
+			lightVec.normalize();
+			Color radiance = l->getRadiance();
+			Color brdf = is.mMaterial->evalBRDF(is, lightVec);
+			float angle = max(lightVec * is.mNormal, 0.0f);
+			emittedC += radiance * brdf * angle * 0.05 + Color(0.005f, 0.005f, 0.005f);
+		}
+	}
+	//return emittedC *(1 - transparency - reflectivity) + refractedC * transparency + reflectedC * reflectivity;
+	return emittedC +refractedC * transparency + reflectedC * reflectivity;
 }
 
@@ -12,6 +12,9 @@
 
 #include "raytracer.h"
 
+struct RayPacket;
+class Intersection;
+
 /**
  * Class implementing a simple Whitted-style raytracer. 
  * The tracePixel() function is called once for each pixel on the
@@ -33,8 +36,9 @@ protected:
 	Color tracePixel(int x, int y);
 	Color tracePixelDOF(int x, int y);
 	Color trace(const Ray& ray, int depth);
-private:
-	int nbrRays = 0;
+	void tracePacket(const RayPacket& packet, Color* colors);
+	Color shade(const Intersection& is, int depth, unsigned int occluded, int knownLights);
+	void renderTile(int x0, int y0, int x1, int y1);
 };
 
 #endif